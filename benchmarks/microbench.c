@@ -0,0 +1,316 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+// Microbenchmarks for the data structures under the interpreter: table_t
+// with number, string and object keys, string interning, concatenation
+// and reallocate(). Every result is in nanoseconds per operation.
+//
+// The collector is kept off so only the data structure is measured. Every
+// object lives until free_vm().
+
+#ifdef DEBUG_STRESS_GC
+#error "The microbenchmarks need the collector off, build without DEBUG_STRESS_GC"
+#endif
+
+#define TARGET_OPS (4 * 1024 * 1024)
+
+static const int table_sizes[] = { 16, 256, 4096, 65536, 1048576 };
+static const int intern_sizes[] = { 1024, 65536, 1048576 };
+static const int operand_lengths[] = { 8, 64, 1024 };
+static const size_t block_sizes[] = { 16, 256, 4096, 65536, 1048576 };
+
+static volatile uint64_t sink; // Results go here, so no loop is optimised away
+
+static uint64_t now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+}
+
+static double ns_per_op(uint64_t start, long ops)
+{
+    return (double)(now() - start) / (double)ops;
+}
+
+static int rounds_for(int size)
+{
+    int rounds = TARGET_OPS / size;
+    return rounds < 1 ? 1 : rounds;
+}
+
+// The same pseudo random order on every run
+static int *shuffled(int count)
+{
+    int *order = (int*)malloc(sizeof(int) * count);
+    if (order == NULL) exit(1);
+    for (int i = 0; i < count; i++) order[i] = i;
+
+    uint32_t state = 2463534242u;
+    for (int i = count - 1; i > 0; i--) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        int j = (int)(state % (uint32_t)(i + 1));
+        int swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+    return order;
+}
+
+typedef enum {
+    KEY_NUMBER,
+    KEY_STRING,
+    KEY_OBJECT,
+} key_kind_e;
+
+static const char *key_kind_names[] = { "number", "string", "object" };
+
+// Twice as many keys as the table gets, the second half is for misses
+static value_t *make_keys(key_kind_e kind, int count)
+{
+    value_t *keys = (value_t*)malloc(sizeof(value_t) * count * 2);
+    if (keys == NULL) exit(1);
+
+    char name[32];
+    for (int i = 0; i < count * 2; i++) {
+        switch (kind) {
+            case KEY_NUMBER:
+                keys[i] = NUMBER_VAL(i);
+                break;
+            case KEY_STRING: {
+                int length = snprintf(name, sizeof(name), "key%d_%d", count, i);
+                keys[i] = OBJ_VAL(allocate_string(name, length));
+                break;
+            }
+            case KEY_OBJECT:
+                keys[i] = OBJ_VAL(new_array());
+                break;
+        }
+    }
+    return keys;
+}
+
+static void fill(table_t *table, value_t *keys, int count)
+{
+    init_table(table);
+    for (int i = 0; i < count; i++) table_set(table, keys[i], NUMBER_VAL(i));
+}
+
+static void bench_table(key_kind_e kind, int size)
+{
+    value_t *keys = make_keys(kind, size);
+    int *order = shuffled(size);
+    int rounds = rounds_for(size);
+    long ops = (long)rounds * size;
+    table_t table;
+    value_t value;
+    uint64_t found = 0;
+
+    uint64_t start = now();
+    for (int round = 0; round < rounds; round++) {
+        fill(&table, keys, size);
+        free_table(&table);
+    }
+    double set = ns_per_op(start, ops);
+
+    fill(&table, keys, size);
+    double average_probes;
+    int longest_probe;
+    table_probe_stats(&table, &average_probes, &longest_probe);
+
+    start = now();
+    for (int round = 0; round < rounds; round++) {
+        for (int i = 0; i < size; i++) found += table_get(&table, keys[order[i]], &value);
+    }
+    double get = ns_per_op(start, ops);
+
+    start = now();
+    for (int round = 0; round < rounds; round++) {
+        for (int i = 0; i < size; i++) found += table_get(&table, keys[size + order[i]], &value);
+    }
+    double miss = ns_per_op(start, ops);
+    free_table(&table);
+
+    uint64_t elapsed = 0;
+    for (int round = 0; round < rounds; round++) {
+        fill(&table, keys, size);
+        start = now();
+        for (int i = 0; i < size; i++) found += table_delete(&table, keys[order[i]]);
+        elapsed += now() - start;
+        free_table(&table);
+    }
+    double delete = (double)elapsed / (double)ops;
+
+    sink += found;
+    printf("table   %-7s %8d  set %7.1f  get %7.1f  miss %7.1f  delete %7.1f"
+           "  probes %.2f avg %d max\n",
+           key_kind_names[kind], size, set, get, miss, delete, average_probes, longest_probe);
+
+    free(order);
+    free(keys);
+}
+
+static char **make_names(const char *prefix, int count, int *lengths)
+{
+    char **names = (char**)malloc(sizeof(char*) * count);
+    if (names == NULL) exit(1);
+
+    for (int i = 0; i < count; i++) {
+        char name[48];
+        lengths[i] = snprintf(name, sizeof(name), "%s%d", prefix, i);
+        names[i] = (char*)malloc((size_t)lengths[i] + 1);
+        if (names[i] == NULL) exit(1);
+        memcpy(names[i], name, (size_t)lengths[i] + 1);
+    }
+    return names;
+}
+
+// allocate_string() of names never seen before, then of the same names again
+static void bench_intern(int size)
+{
+    char prefix[32];
+    snprintf(prefix, sizeof(prefix), "intern%d_", size);
+    int *lengths = (int*)malloc(sizeof(int) * size);
+    if (lengths == NULL) exit(1);
+    char **names = make_names(prefix, size, lengths);
+
+    uint64_t start = now();
+    for (int i = 0; i < size; i++) sink += allocate_string(names[i], lengths[i])->hash;
+    double fresh = ns_per_op(start, size);
+
+    int rounds = rounds_for(size);
+    start = now();
+    for (int round = 0; round < rounds; round++) {
+        for (int i = 0; i < size; i++) sink += allocate_string(names[i], lengths[i])->hash;
+    }
+    double interned = ns_per_op(start, (long)rounds * size);
+
+    printf("intern          %8d  new %7.1f  interned %7.1f\n", size, fresh, interned);
+
+    for (int i = 0; i < size; i++) free(names[i]);
+    free(names);
+    free(lengths);
+}
+
+// concatenate_strings() with results that are new, then with results that
+// are already interned
+static void bench_concatenate(int length)
+{
+    const int count = 65536;
+    char *text = (char*)malloc((size_t)length + 16);
+    if (text == NULL) exit(1);
+    memset(text, 'x', (size_t)length);
+
+    obj_string_t **left = (obj_string_t**)malloc(sizeof(obj_string_t*) * count);
+    if (left == NULL) exit(1);
+    for (int i = 0; i < count; i++) {
+        int digits = snprintf(text + length, 16, "%d", i);
+        left[i] = allocate_string(text, length + digits);
+    }
+    obj_string_t *right = allocate_string(text, length);
+
+    uint64_t start = now();
+    for (int i = 0; i < count; i++) sink += concatenate_strings(left[i], right)->length;
+    double fresh = ns_per_op(start, count);
+
+    start = now();
+    for (int i = 0; i < count; i++) sink += concatenate_strings(left[i], right)->length;
+    double interned = ns_per_op(start, count);
+
+    printf("concat  %5d+%-5d         new %7.1f  interned %7.1f\n",
+           length, length, fresh, interned);
+
+    free(left);
+    free(text);
+}
+
+// Batches of blocks allocated and freed again, and a buffer grown by
+// doubling from 8 bytes the way tables and arrays grow
+static void bench_reallocate(size_t size)
+{
+    enum { BATCH = 64 };
+    void *blocks[BATCH];
+    int rounds = rounds_for((int)(size / 16 > 0 ? size / 16 : 1)) / BATCH + 1;
+
+    uint64_t start = now();
+    for (int round = 0; round < rounds; round++) {
+        for (int i = 0; i < BATCH; i++) {
+            blocks[i] = reallocate(NULL, 0, size);
+            ((char*)blocks[i])[0] = (char)i;
+        }
+        for (int i = 0; i < BATCH; i++) {
+            sink += ((char*)blocks[i])[0];
+            reallocate(blocks[i], size, 0);
+        }
+    }
+    double churn = ns_per_op(start, (long)rounds * BATCH);
+
+    int grows = 0;
+    start = now();
+    for (int round = 0; round < rounds; round++) {
+        char *buffer = NULL;
+        for (size_t capacity = 8, old = 0; capacity <= size; old = capacity, capacity *= 2) {
+            buffer = (char*)reallocate(buffer, old, capacity);
+            buffer[capacity - 1] = 1;
+            grows++;
+        }
+        reallocate(buffer, size, 0);
+    }
+    double grow = ns_per_op(start, grows);
+
+    printf("realloc         %8zu  alloc+free %7.1f  grow %7.1f\n", size, churn, grow);
+}
+
+static bool selected(int argc, const char **argv, const char *group)
+{
+    if (argc < 2) return true;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], group) == 0) return true;
+    }
+    return false;
+}
+
+int main(int argc, const char **argv)
+{
+    init_vm();
+    vm.next_gc = SIZE_MAX;
+    vm.next_major = SIZE_MAX;
+
+    printf("ns per operation\n");
+    if (selected(argc, argv, "table")) {
+        for (int kind = KEY_NUMBER; kind <= KEY_OBJECT; kind++) {
+            for (size_t i = 0; i < sizeof(table_sizes) / sizeof(table_sizes[0]); i++) {
+                bench_table((key_kind_e)kind, table_sizes[i]);
+            }
+        }
+    }
+    if (selected(argc, argv, "intern")) {
+        for (size_t i = 0; i < sizeof(intern_sizes) / sizeof(intern_sizes[0]); i++) {
+            bench_intern(intern_sizes[i]);
+        }
+    }
+    if (selected(argc, argv, "concat")) {
+        for (size_t i = 0; i < sizeof(operand_lengths) / sizeof(operand_lengths[0]); i++) {
+            bench_concatenate(operand_lengths[i]);
+        }
+    }
+    if (selected(argc, argv, "realloc")) {
+        for (size_t i = 0; i < sizeof(block_sizes) / sizeof(block_sizes[0]); i++) {
+            bench_reallocate(block_sizes[i]);
+        }
+    }
+
+    free_vm();
+    return 0;
+}
@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+"""Runs the clox benchmark suite.
+
+Every benchmarks/*.lox script is run several times in a fresh process.
+The wall clock time of each run is measured and the median, spread and
+standard deviation are reported as JSON. The last line each script prints
+is kept as its result, so a change that breaks a workload shows up next to
+its timing.
+
+With --baseline the results are compared with an earlier JSON file. A
+change counts only when it is bigger than the spread of both runs.
+
+usage: run.py --clox path/to/clox [--runs N] [--output results.json]
+              [--baseline old.json] [--args "--gc=concurrent"] [names...]
+"""
+
+import argparse
+import glob
+import json
+import os
+import resource
+import shlex
+import statistics
+import subprocess
+import sys
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+
+def run_once(command):
+    before = resource.getrusage(resource.RUSAGE_CHILDREN)
+    start = time.perf_counter()
+    process = subprocess.run(command, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    wall = time.perf_counter() - start
+    after = resource.getrusage(resource.RUSAGE_CHILDREN)
+
+    if process.returncode != 0:
+        sys.stderr.write(process.stderr.decode("utf-8", "replace"))
+        raise SystemExit("%s failed with exit code %d" % (" ".join(command), process.returncode))
+
+    cpu = (after.ru_utime - before.ru_utime) + (after.ru_stime - before.ru_stime)
+    lines = process.stdout.decode("utf-8", "replace").splitlines()
+    return wall, cpu, lines[-1] if lines else ""
+
+
+def measure(clox, args, path, runs, warmup):
+    command = [clox] + args + [path]
+    for _ in range(warmup):
+        run_once(command)
+
+    walls, cpus = [], []
+    output = ""
+    for _ in range(runs):
+        wall, cpu, output = run_once(command)
+        walls.append(wall)
+        cpus.append(cpu)
+
+    median = statistics.median(walls)
+    return {
+        "median": median,
+        "min": min(walls),
+        "max": max(walls),
+        "mean": statistics.mean(walls),
+        "stdev": statistics.stdev(walls) if len(walls) > 1 else 0.0,
+        "spread": (max(walls) - min(walls)) / median if median > 0 else 0.0,
+        "cpu_median": statistics.median(cpus),
+        "result": output,
+        "times": walls,
+    }
+
+
+def compare(results, baseline):
+    print()
+    print("%-18s %10s %10s %9s" % ("benchmark", "baseline", "now", "change"))
+    for name, now in results.items():
+        old = baseline.get(name)
+        if old is None:
+            print("%-18s %10s %9.3fs %9s" % (name, "-", now["median"], "new"))
+            continue
+
+        change = now["median"] / old["median"] - 1
+        noise = max(now["spread"], old["spread"])
+        verdict = "" if abs(change) <= noise else ("slower" if change > 0 else "faster")
+        if now["result"] != old["result"]:
+            verdict += " result %r, was %r" % (now["result"], old["result"])
+        print("%-18s %9.3fs %9.3fs %+8.1f%% %s" % (name, old["median"], now["median"],
+                                                   change * 100, verdict))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--clox", required=True, help="the interpreter to run")
+    parser.add_argument("--runs", type=int, default=5)
+    parser.add_argument("--warmup", type=int, default=1, help="untimed runs before measuring")
+    parser.add_argument("--args", default="", help="options passed to the interpreter")
+    parser.add_argument("--output", help="write the results here")
+    parser.add_argument("--baseline", help="results of an earlier run to compare with")
+    parser.add_argument("names", nargs="*", help="benchmarks to run, all by default")
+    args = parser.parse_args()
+
+    paths = sorted(glob.glob(os.path.join(HERE, "*.lox")))
+    if args.names:
+        paths = [path for path in paths
+                 if os.path.splitext(os.path.basename(path))[0] in args.names]
+
+    results = {}
+    for path in paths:
+        name = os.path.splitext(os.path.basename(path))[0]
+        results[name] = measure(args.clox, shlex.split(args.args), path, args.runs, args.warmup)
+        result = results[name]
+        sys.stderr.write("%-18s median %.3fs  spread %4.1f%%  stdev %.4fs\n" % (
+            name, result["median"], result["spread"] * 100, result["stdev"]))
+
+    report = {
+        "interpreter": os.path.abspath(args.clox),
+        "args": args.args,
+        "runs": args.runs,
+        "benchmarks": results,
+    }
+    text = json.dumps(report, indent=2)
+    if args.output:
+        with open(args.output, "w") as file:
+            file.write(text + "\n")
+    else:
+        print(text)
+
+    if args.baseline:
+        with open(args.baseline) as file:
+            compare(results, json.load(file)["benchmarks"])
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,93 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <math.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "benchmark.h"
+#include "memory.h"
+#include "vm.h"
+
+#define BENCHMARK_MIN_BATCH_NS 1000000 // Long enough for the clock to time well
+#define BENCHMARK_MIN_SAMPLES 5
+
+static uint64_t now_ns(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+}
+
+// Calls the callee count times, false when a call failed. The callee is
+// read from its stack slot every time, a compaction may move it.
+static bool run_batch(value_t *callee, uint64_t count, uint64_t *elapsed)
+{
+    value_t ignored;
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < count; i++) {
+        push(*callee);
+        if (!call_from_native(0, &ignored)) return false;
+    }
+    *elapsed = now_ns() - start;
+    return true;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+bool run_benchmark(value_t *callee, double seconds, benchmark_result_t *result)
+{
+    // Keep the cast to uint64_t defined whatever the caller passed
+    if (!(seconds > 0)) seconds = 0;
+    if (seconds > BENCHMARK_MAX_SECONDS) seconds = BENCHMARK_MAX_SECONDS;
+    uint64_t budget = (uint64_t)(seconds * 1e9);
+    uint64_t start = now_ns();
+
+    // Warm up for a tenth of the time, doubling the batch until one takes
+    // long enough to time
+    uint64_t batch = 1;
+    uint64_t elapsed;
+    for (;;) {
+        if (!run_batch(callee, batch, &elapsed)) return false;
+        bool long_enough = elapsed >= BENCHMARK_MIN_BATCH_NS;
+        if (long_enough && now_ns() - start >= budget / 10) break;
+        if (!long_enough) batch *= 2;
+    }
+
+    double samples[BENCHMARK_MAX_SAMPLES];
+    int count = 0;
+    gc_stats_t before, after;
+    gc_stats(&before);
+    while (count < BENCHMARK_MAX_SAMPLES &&
+           (count < BENCHMARK_MIN_SAMPLES || now_ns() - start < budget)) {
+        if (!run_batch(callee, batch, &elapsed)) return false;
+        samples[count++] = (double)elapsed / (double)batch;
+    }
+    gc_stats(&after);
+
+    double sum = 0;
+    for (int i = 0; i < count; i++) sum += samples[i];
+    result->mean = sum / count;
+
+    double squares = 0;
+    for (int i = 0; i < count; i++) {
+        squares += (samples[i] - result->mean) * (samples[i] - result->mean);
+    }
+    result->stddev = count > 1 ? sqrt(squares / (count - 1)) : 0;
+
+    qsort(samples, (size_t)count, sizeof(double), compare_doubles);
+    result->median = count % 2 == 1 ? samples[count / 2]
+                                    : (samples[count / 2 - 1] + samples[count / 2]) / 2;
+    result->min = samples[0];
+    result->max = samples[count - 1];
+    result->samples = count;
+    result->iterations = (uint64_t)count * batch;
+    result->bytes_allocated = (double)(after.bytes_allocated - before.bytes_allocated);
+    result->collections = (double)(after.cycles - before.cycles);
+    result->gc_pause_ns = (double)(after.pause_ns - before.pause_ns);
+    return true;
+}
@@ -0,0 +1,30 @@
+#ifndef CLOX_BENCHMARK_H
+#define CLOX_BENCHMARK_H
+
+#include "common.h"
+#include "value.h"
+
+#define BENCHMARK_DEFAULT_SECONDS 1.0
+#define BENCHMARK_MAX_SECONDS 3600.0
+#define BENCHMARK_MAX_SAMPLES 100
+
+// In-script microbenchmarks, see the benchmark() native. The callee, kept
+// in a stack slot, is called without arguments, first to warm up and to find how many calls
+// make a batch long enough to time, then batch by batch until the time is
+// up. Every batch gives one sample of the time per call.
+typedef struct {
+    double mean; // Nanoseconds per call
+    double median;
+    double stddev;
+    double min;
+    double max;
+    int samples;
+    uint64_t iterations; // Calls measured, without the warmup
+    double bytes_allocated; // By the measured calls
+    double collections; // Collection cycles started during them
+    double gc_pause_ns; // Time they stood still for the collector
+} benchmark_result_t;
+
+bool run_benchmark(value_t *callee, double seconds, benchmark_result_t *result);
+
+#endif
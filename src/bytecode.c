@@ -0,0 +1,532 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "chunk.h"
+#include "memory.h"
+#include "serial.h"
+#include "vm.h"
+
+#define BYTECODE_MAX_DEPTH 256 // Functions nested deeper make the file invalid
+#define BYTECODE_NO_NAME UINT32_MAX
+
+typedef enum {
+    CONSTANT_NIL,
+    CONSTANT_FALSE,
+    CONSTANT_TRUE,
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION,
+} constant_tag_e;
+
+// Header: "LOXC", the format version, the opcode count, the length and
+// hash of the source, then the hash of everything after the header.
+// Integers are in the byte order of the machine that wrote the file, a
+// different one fails the version check.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t op_code_count;
+    uint32_t reserved;
+    uint64_t source_length;
+    uint64_t source_hash;
+    uint64_t payload_hash; // Filled in once the payload is written
+} bytecode_header_t;
+
+#define BYTECODE_HASH_SEED 14695981039346656037u
+#define BYTECODE_MATCHED_BYTES offsetof(bytecode_header_t, payload_hash)
+
+// FNV-1a, continued from hash so a file can be hashed piece by piece
+static uint64_t hash_bytes(uint64_t hash, const void *bytes, size_t length)
+{
+    for (size_t i = 0; i < length; i++) {
+        hash ^= ((const uint8_t*)bytes)[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+static void make_header(bytecode_header_t *header, const char *source)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, "LOXC", 4);
+    header->version = BYTECODE_VERSION;
+    header->op_code_count = OP_CODE_COUNT;
+    header->source_length = strlen(source);
+    header->source_hash = hash_bytes(BYTECODE_HASH_SEED, source, (size_t)header->source_length);
+}
+
+// script.lox caches in script.loxc, other names get .loxc appended
+char *bytecode_path(const char *script_path)
+{
+    size_t length = strlen(script_path);
+    bool is_lox = length > 4 && strcmp(script_path + length - 4, ".lox") == 0;
+    char *path = (char*)malloc(length + 6);
+    if (path == NULL) return NULL;
+
+    memcpy(path, script_path, length);
+    strcpy(path + length, is_lox ? "c" : ".loxc");
+    return path;
+}
+
+static void write_function(FILE *file, obj_function_t *function)
+{
+    write_u32(file, (uint32_t)function->arity);
+    write_u32(file, (uint32_t)function->upvalue_count);
+    if (function->name == NULL) {
+        write_u32(file, BYTECODE_NO_NAME);
+    } else {
+        write_counted(file, function->name->chars, (uint32_t)function->name->length);
+    }
+
+    chunk_t *chunk = &function->chunk;
+    write_code(file, chunk);
+
+    write_u32(file, (uint32_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        value_t constant = chunk->constants.values[i];
+        if (IS_NIL(constant)) {
+            fputc(CONSTANT_NIL, file);
+        } else if (IS_BOOL(constant)) {
+            fputc(AS_BOOL(constant) ? CONSTANT_TRUE : CONSTANT_FALSE, file);
+        } else if (IS_NUMBER(constant)) {
+            double number = AS_NUMBER(constant);
+            fputc(CONSTANT_NUMBER, file);
+            write_double(file, number);
+        } else if (IS_STRING(constant)) {
+            fputc(CONSTANT_STRING, file);
+            write_counted(file, AS_STRING(constant)->chars, (uint32_t)AS_STRING(constant)->length);
+        } else {
+            fputc(CONSTANT_FUNCTION, file);
+            write_function(file, AS_FUNCTION(constant));
+        }
+    }
+}
+
+typedef struct {
+    obj_function_t *script;
+    const char *source;
+} bytecode_t;
+
+// Hashes the payload by reading it back, then writes the header again
+// with the hash
+static bool write_payload_hash(FILE *file, bytecode_header_t *header)
+{
+    if (fflush(file) != 0 || fseek(file, (long)sizeof(*header), SEEK_SET) != 0) return false;
+
+    uint64_t hash = BYTECODE_HASH_SEED;
+    uint8_t buffer[4096];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        hash = hash_bytes(hash, buffer, count);
+    }
+    if (ferror(file) || fseek(file, 0L, SEEK_SET) != 0) return false;
+
+    header->payload_hash = hash;
+    return fwrite(header, sizeof(*header), 1, file) == 1;
+}
+
+static bool write_contents(FILE *file, void *data)
+{
+    bytecode_t *bytecode = (bytecode_t*)data;
+    bytecode_header_t header;
+    make_header(&header, bytecode->source);
+    fwrite(&header, sizeof(header), 1, file);
+    write_function(file, bytecode->script);
+    return write_payload_hash(file, &header);
+}
+
+bool write_bytecode(const char *path, obj_function_t *script, const char *source)
+{
+    bytecode_t bytecode = { script, source };
+    return write_file_atomically(path, write_contents, &bytecode);
+}
+
+static obj_function_t *read_function(reader_t *reader, int depth);
+
+static bool read_constant(reader_t *reader, chunk_t *chunk, int depth)
+{
+    switch (read_u8(reader)) {
+        case CONSTANT_NIL: add_constant(chunk, NIL_VAL); return true;
+        case CONSTANT_FALSE: add_constant(chunk, BOOL_VAL(false)); return true;
+        case CONSTANT_TRUE: add_constant(chunk, BOOL_VAL(true)); return true;
+        case CONSTANT_NUMBER:
+            add_constant(chunk, NUMBER_VAL(read_double(reader)));
+            return !reader->failed;
+        case CONSTANT_STRING: {
+            obj_string_t *string = read_string(reader, read_u32(reader));
+            if (string == NULL) return false;
+            add_constant(chunk, OBJ_VAL(string));
+            return true;
+        }
+        case CONSTANT_FUNCTION: {
+            obj_function_t *function = read_function(reader, depth + 1);
+            if (function == NULL) return false;
+            add_constant(chunk, OBJ_VAL(function));
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+// Length of an instruction with its operands, 0 for an unknown opcode.
+// OP_CLOSURE is followed by a pair of bytes per upvalue as well.
+static int instruction_length(uint8_t instruction)
+{
+    switch (instruction) {
+        case OP_CONSTANT_16:
+        case OP_DEFINE_GLOBAL_16:
+        case OP_GET_GLOBAL_16:
+        case OP_SET_GLOBAL_16:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+            return 3;
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_CLOSURE:
+        case OP_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_ARRAY:
+            return 2;
+        default:
+            return instruction < OP_CODE_COUNT ? 1 : 0;
+    }
+}
+
+static bool is_constant_of(chunk_t *chunk, int index, bool (*is_type)(value_t))
+{
+    return index < chunk->constants.count &&
+           (is_type == NULL || is_type(chunk->constants.values[index]));
+}
+
+static bool is_string(value_t value)
+{
+    return IS_STRING(value);
+}
+
+static bool is_function(value_t value)
+{
+    return IS_FUNCTION(value);
+}
+
+// Checks one instruction that starts at offset and fits in the code. The
+// constants it names exist and have the type the VM casts them to.
+static bool verify_instruction(obj_function_t *function, int offset, int *length)
+{
+    chunk_t *chunk = &function->chunk;
+    uint8_t *code = chunk->code + offset;
+    *length = instruction_length(code[0]);
+    if (*length == 0 || *length > chunk->count - offset) return false;
+
+    int byte = *length > 1 ? code[1] : 0;
+    int two_bytes = *length > 2 ? code[1] | (code[2] << 8) : 0;
+
+    switch (code[0]) {
+        case OP_CONSTANT: return is_constant_of(chunk, byte, NULL);
+        case OP_CONSTANT_16: return is_constant_of(chunk, two_bytes, NULL);
+        case OP_DEFINE_GLOBAL_16:
+        case OP_GET_GLOBAL_16:
+        case OP_SET_GLOBAL_16:
+            return is_constant_of(chunk, two_bytes, is_string);
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_CLASS:
+        case OP_METHOD:
+            return is_constant_of(chunk, byte, is_string);
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+            return byte < function->upvalue_count;
+        case OP_CLOSURE: {
+            if (!is_constant_of(chunk, byte, is_function)) return false;
+            obj_function_t *closed = AS_FUNCTION(chunk->constants.values[byte]);
+            *length += 2 * closed->upvalue_count;
+            if (*length > chunk->count - offset) return false;
+            for (int i = 0; i < closed->upvalue_count; i++) {
+                uint8_t is_local = code[2 + 2 * i];
+                uint8_t index = code[3 + 2 * i];
+                if (is_local > 1 || (!is_local && index >= function->upvalue_count)) return false;
+            }
+            return true;
+        }
+        default:
+            return true;
+    }
+}
+
+// How many values an instruction needs on the stack and how it changes
+// the height
+static void stack_effect(const uint8_t *code, int *needed, int *change)
+{
+    *needed = 0;
+    *change = 0;
+    switch (code[0]) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_16:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_16:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+        case OP_CLASS:
+            *change = 1;
+            return;
+        case OP_DUP:
+            *needed = 1;
+            *change = 1;
+            return;
+        case OP_SET_LOCAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_16:
+        case OP_SET_UPVALUE:
+        case OP_GET_PROPERTY:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_JUMP_IF_FALSE:
+        case OP_RETURN:
+            *needed = 1;
+            return;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_16:
+        case OP_CLOSE_UPVALUE:
+        case OP_PRINT:
+            *needed = 1;
+            *change = -1;
+            return;
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MODULUS:
+        case OP_INHERIT:
+        case OP_METHOD:
+        case OP_GET_INDEX:
+            *needed = 2;
+            *change = -1;
+            return;
+        case OP_SET_INDEX:
+            *needed = 3;
+            *change = -2;
+            return;
+        case OP_CALL:
+            *needed = code[1] + 1;
+            *change = -code[1];
+            return;
+        case OP_INVOKE:
+            *needed = code[2] + 1;
+            *change = -code[2];
+            return;
+        case OP_SUPER_INVOKE:
+            *needed = code[2] + 2;
+            *change = -code[2] - 1;
+            return;
+        case OP_ARRAY:
+            *needed = code[1];
+            *change = 1 - code[1];
+            return;
+        default:
+            return;
+    }
+}
+
+// Follows every path from the entry, where the callee and the arguments
+// are on the stack, keeping the lowest and highest height each
+// instruction can be reached with. Paths may meet at different heights (a
+// switch case that falls through pops once more), so an instruction must
+// find the values it takes and its locals at the lowest height, and the
+// highest must stay within a frame. No path may run past the end.
+static bool verify_stack(obj_function_t *function, const bool *starts)
+{
+    chunk_t *chunk = &function->chunk;
+    size_t count = (size_t)chunk->count;
+    int *lowest = (int*)malloc(count * sizeof(int));
+    int *highest = (int*)malloc(count * sizeof(int));
+    int *pending = (int*)malloc(count * sizeof(int));
+    bool *is_pending = (bool*)calloc(count, sizeof(bool));
+    bool is_valid = lowest != NULL && highest != NULL && pending != NULL && is_pending != NULL;
+    for (size_t i = 0; is_valid && i < count; i++) lowest[i] = -1;
+
+    int pending_count = 0;
+    if (is_valid) {
+        lowest[0] = highest[0] = function->arity + 1;
+        pending[pending_count++] = 0;
+        is_pending[0] = true;
+    }
+
+    while (is_valid && pending_count > 0) {
+        int offset = pending[--pending_count];
+        is_pending[offset] = false;
+        const uint8_t *code = chunk->code + offset;
+        int length, needed, change;
+        verify_instruction(function, offset, &length);
+        stack_effect(code, &needed, &change);
+
+        int low = lowest[offset];
+        int high = highest[offset];
+        is_valid = low >= needed && high + change <= UINT8_COUNT;
+        if ((code[0] == OP_GET_LOCAL || code[0] == OP_SET_LOCAL) && code[1] >= low) {
+            is_valid = false;
+        }
+        for (int i = 2; code[0] == OP_CLOSURE && i < length; i += 2) {
+            if (code[i] && code[i + 1] >= low) is_valid = false;
+        }
+        if (code[0] == OP_RETURN) continue;
+
+        int targets[2];
+        int target_count = 0;
+        if (code[0] != OP_JUMP && code[0] != OP_LOOP) targets[target_count++] = offset + length;
+        if (code[0] == OP_JUMP || code[0] == OP_JUMP_IF_FALSE || code[0] == OP_LOOP) {
+            int jump = code[1] | (code[2] << 8);
+            targets[target_count++] = offset + 3 + (code[0] == OP_LOOP ? -jump : jump);
+        }
+
+        for (int i = 0; is_valid && i < target_count; i++) {
+            int target = targets[i];
+            if (target < 0 || target >= chunk->count || !starts[target]) {
+                is_valid = false;
+                break;
+            }
+
+            // Widen the range of the target, and look at it again if it grew
+            int target_low = low + change;
+            int target_high = high + change;
+            if (lowest[target] >= 0) {
+                if (lowest[target] <= target_low && highest[target] >= target_high) continue;
+                if (lowest[target] < target_low) target_low = lowest[target];
+                if (highest[target] > target_high) target_high = highest[target];
+            }
+            lowest[target] = target_low;
+            highest[target] = target_high;
+            if (!is_pending[target]) {
+                pending[pending_count++] = target;
+                is_pending[target] = true;
+            }
+        }
+    }
+
+    free(lowest);
+    free(highest);
+    free(pending);
+    free(is_pending);
+    return is_valid;
+}
+
+// The VM trusts the code it runs, so a cache is checked before it is
+// used: every instruction is known and ends inside the code, its constants
+// and upvalues exist, and verify_stack() holds.
+static bool verify_code(obj_function_t *function)
+{
+    chunk_t *chunk = &function->chunk;
+    bool *starts = (bool*)calloc((size_t)chunk->count, sizeof(bool));
+    if (starts == NULL) return false;
+
+    bool is_valid = true;
+    int length = 0;
+    for (int offset = 0; is_valid && offset < chunk->count; offset += length) {
+        starts[offset] = true;
+        is_valid = verify_instruction(function, offset, &length);
+    }
+    is_valid = is_valid && verify_stack(function, starts);
+
+    free(starts);
+    return is_valid;
+}
+
+// The function stays on the stack while it is filled in, reading its
+// constants allocates. Like the compiler it may have aged meanwhile, so
+// every store into it goes through the write barrier.
+static obj_function_t *read_function(reader_t *reader, int depth)
+{
+    if (depth > BYTECODE_MAX_DEPTH) return NULL;
+
+    obj_function_t *function = new_function();
+    push(OBJ_VAL(function));
+    uint32_t arity = read_u32(reader);
+    uint32_t upvalue_count = read_u32(reader);
+    if (arity > UINT8_MAX || upvalue_count > UINT8_COUNT) {
+        pop();
+        return NULL;
+    }
+    function->arity = (int)arity;
+    function->upvalue_count = (int)upvalue_count;
+
+    uint32_t name_length = read_u32(reader);
+    if (name_length != BYTECODE_NO_NAME) {
+        function->name = read_string(reader, name_length);
+        write_barrier((obj_t*)function);
+    }
+
+    chunk_t *chunk = &function->chunk;
+    bool is_valid = !reader->failed && read_code(reader, chunk);
+    uint32_t constants = is_valid ? read_u32(reader) : 0;
+    for (uint32_t i = 0; is_valid && i < constants; i++) {
+        is_valid = read_constant(reader, chunk, depth);
+        write_barrier((obj_t*)function);
+    }
+
+    is_valid = is_valid && !reader->failed && verify_code(function);
+    pop();
+    return is_valid ? function : NULL;
+}
+
+static obj_function_t *read_bytecode(const uint8_t *bytes, size_t size, const char *source)
+{
+    bytecode_header_t expected;
+    make_header(&expected, source);
+    if (size < sizeof(expected) || memcmp(bytes, &expected, BYTECODE_MATCHED_BYTES) != 0) {
+        return NULL;
+    }
+
+    bytecode_header_t header;
+    memcpy(&header, bytes, sizeof(header));
+    size_t payload = size - sizeof(header);
+    if (hash_bytes(BYTECODE_HASH_SEED, bytes + sizeof(header), payload) != header.payload_hash) {
+        return NULL;
+    }
+
+    reader_t reader = { bytes + sizeof(expected), bytes + size, false };
+    obj_function_t *script = read_function(&reader, 0);
+    if (script == NULL || script->arity != 0 || script->upvalue_count != 0) return NULL;
+    return reader.at == reader.end ? script : NULL;
+}
+
+// NULL when there is no cache or it doesn't match the source, the caller
+// compiles the source then. Functions of a rejected file are left to the
+// collector.
+obj_function_t *load_bytecode(const char *path, const char *source)
+{
+    mapped_file_t file;
+    if (!map_file(path, &file)) return NULL;
+    obj_function_t *script = read_bytecode(file.bytes, file.size, source);
+    unmap_file(&file);
+    return script;
+}
@@ -0,0 +1,21 @@
+#ifndef CLOX_BYTECODE_H
+#define CLOX_BYTECODE_H
+
+#include "object.h"
+
+#define BYTECODE_VERSION 2
+
+// Compiled scripts, cached in a .loxc file next to the script. The file
+// holds the script function and, nested in its constants, every function
+// it declares: their code, lines, constants and upvalue counts (the
+// upvalue descriptors are part of the code after OP_CLOSURE). It also
+// records the hash and length of the source it was compiled from, so a
+// cache that no longer matches its script is ignored. A checksum of the
+// contents catches damaged files, and the code of every function is
+// verified before it is used (see verify_code), so a file that fails
+// either check is ignored as well and the script is compiled instead.
+char *bytecode_path(const char *script_path);
+bool write_bytecode(const char *path, obj_function_t *script, const char *source);
+obj_function_t *load_bytecode(const char *path, const char *source);
+
+#endif
@@ -1,4 +1,5 @@
 #include "chunk.h"
+#include "coverage.h"
 #include "memory.h"
 #include "vm.h"
 
@@ -9,10 +10,13 @@ void init_chunk(chunk_t *chunk)
     chunk->code = NULL;
     chunk->lines = NULL;
     init_value_array(&chunk->constants);
+    chunk->hits = NULL;
+    chunk->trace_id = 0;
 }
 
 void free_chunk(chunk_t *chunk)
 {
+    if (vm.coverage) forget_hits(chunk);
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
     free_value_array(&chunk->constants);
@@ -53,6 +53,8 @@ typedef enum {
     OP_RETURN,
 } op_code_e;
 
+#define OP_CODE_COUNT (OP_RETURN + 1)
+
 // Holds bytecode stuff
 typedef struct {
     int count;
@@ -60,6 +62,8 @@ typedef struct {
     uint8_t *code;
     int *lines;
     value_array_t constants;
+    uint64_t *hits; // Executions per instruction, only with --coverage
+    int trace_id; // Number in the --trace function table plus one, 0 until traced
 } chunk_t;
 
 void init_chunk(chunk_t *chunk);
@@ -5,13 +5,30 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define DEBUG_TRACE_EXECUTION
-#define DEBUG_PRINT_CODE
+// #define DEBUG_PRINT_CODE
 // #define DEBUG_STRESS_GC
-#define DEBUG_LOG_GC
+// #define DEBUG_LOG_GC
 
 #define NAN_BOXING
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// The concurrent marker reads table and constant buffers while the program
+// grows them. A grown buffer is published with release stores and read
+// with acquire loads, so a size is never paired with a smaller buffer.
+// SIGNAL_FENCE keeps the compiler from moving stores across it, for state
+// a signal handler reads (the CPU profiler walks vm.frames). ALWAYS_INLINE
+// makes sure a function is specialised for every constant it is called with.
+#if defined(__GNUC__) || defined(__clang__)
+#define LOAD_ACQUIRE(lvalue) __atomic_load_n(&(lvalue), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(lvalue, value) __atomic_store_n(&(lvalue), (value), __ATOMIC_RELEASE)
+#define SIGNAL_FENCE() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define LOAD_ACQUIRE(lvalue) (lvalue)
+#define STORE_RELEASE(lvalue, value) ((lvalue) = (value))
+#define SIGNAL_FENCE() ((void)0)
+#define ALWAYS_INLINE inline
+#endif
+
 #endif
@@ -10,6 +10,7 @@
 #include "value.h"
 #include "object.h"
 #include "memory.h"
+#include "vm.h"
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
@@ -212,7 +213,10 @@ static void emit_return(void)
 
 static int make_constant(value_t value)
 {
-    return add_constant(current_chunk(), value);
+    int constant = add_constant(current_chunk(), value);
+    // Compiling allocates, so the function may already be an old object
+    write_barrier((obj_t*)current->function);
+    return constant;
 }
 
 static void emit_constant(value_t value)
@@ -242,7 +246,8 @@ static void patch_jump(int offset)
     current_chunk()->code[offset + 1] = (jump >> 8) & 0xFF;
 }
 
-static void init_compiler(compiler_t *compiler, function_type_e type)
+// Compiles into function, or into a new one when it is NULL
+static void init_compiler(compiler_t *compiler, function_type_e type, obj_function_t *function)
 {
     compiler->enclosing = current;
     compiler->function = NULL;
@@ -250,11 +255,12 @@ static void init_compiler(compiler_t *compiler, function_type_e type)
     compiler->local_count = 0;
     compiler->scope_depth = 0;
     compiler->control_stack_top = -1;
-    compiler->function = new_function();
+    compiler->function = function != NULL ? function : new_function();
     current = compiler;
-    if (type != TYPE_SCRIPT) {
+    if (type != TYPE_SCRIPT && function == NULL) {
         current->function->name = allocate_string(parser.previous.start,
                                                   parser.previous.length);
+        write_barrier((obj_t*)current->function);
     }
 
     local_t *local = &current->locals[current->local_count++];
@@ -387,12 +393,8 @@ static void block(void)
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(function_type_e type)
+static void parameters(void)
 {
-    compiler_t compiler;
-    init_compiler(&compiler, type);
-    begin_scope();
-
     consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
     if (!check(TOKEN_RIGHT_PAREN)) {
         do {
@@ -406,9 +408,86 @@ static void function(function_type_e type)
     }
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
     consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-    block();
+}
 
-    obj_function_t *function = end_compiler();
+// Whether the name is a local of a function around the current one. The
+// slot a script reserves for itself is never captured.
+static bool is_enclosing_local(token_t *name)
+{
+    for (compiler_t *compiler = current->enclosing; compiler != NULL; compiler = compiler->enclosing) {
+        for (int i = compiler->type == TYPE_SCRIPT ? 1 : 0; i < compiler->local_count; i++) {
+            if (identifiers_equal(name, &compiler->locals[i].name)) return true;
+        }
+    }
+    return false;
+}
+
+// Pre-parse: skips the body, whose '{' was just consumed, keeping its
+// source to compile on the first call. The closure of a skipped function
+// has no upvalues, so a body naming a local of an enclosing function (it
+// may capture it) is left to the compiler, as is a body with a scanner
+// error or no end. The scanner is back at the '{' then.
+static bool skip_body(const char *start, int line)
+{
+    scanner_t scanner_state = save_scanner();
+    parser_t parser_state = parser;
+
+    int depth = 1;
+    token_type_e before = TOKEN_LEFT_BRACE;
+    for (token_t token = parser.current;; before = token.type, token = scan_token()) {
+        switch (token.type) {
+            case TOKEN_LEFT_BRACE: depth++; break;
+            case TOKEN_RIGHT_BRACE: depth--; break;
+            case TOKEN_IDENTIFIER:
+            case TOKEN_THIS:
+            case TOKEN_SUPER:
+                if (before != TOKEN_DOT && is_enclosing_local(&token)) goto compile_now;
+                break;
+            case TOKEN_ERROR:
+            case TOKEN_EOF:
+                goto compile_now;
+            default:
+                break;
+        }
+        if (depth == 0) {
+            parser.current = token;
+            advance();
+            break;
+        }
+    }
+
+    const char *end = parser.previous.start + parser.previous.length;
+    lazy_source_t *lazy = new_lazy_source(start, (int)(end - start), line);
+    lazy->type = (uint8_t)current->type;
+    lazy->in_class = current_class != NULL;
+    lazy->has_superclass = current_class != NULL && current_class->has_superclass;
+    current->function->lazy = lazy;
+    return true;
+
+compile_now:
+    restore_scanner(scanner_state);
+    parser = parser_state;
+    return false;
+}
+
+static void function(function_type_e type)
+{
+    compiler_t compiler;
+    init_compiler(&compiler, type, NULL);
+    begin_scope();
+
+    const char *start = parser.current.start;
+    int line = parser.current.line;
+    parameters();
+
+    obj_function_t *function;
+    if (vm.lazy_compile && skip_body(start, line)) {
+        function = current->function;
+        current = current->enclosing;
+    } else {
+        block();
+        function = end_compiler();
+    }
     emit_bytes(OP_CLOSURE, make_constant(OBJ_VAL(function)));
 
     for (int i = 0; i < function->upvalue_count; i++) {
@@ -1184,7 +1263,7 @@ static void parse_precedence(precedence_e precedence)
 static int identifier_constant(token_t *name)
 {
     obj_string_t *interned = allocate_string(name->start, name->length);
-    return add_constant(current_chunk(), OBJ_VAL(interned));
+    return make_constant(OBJ_VAL(interned));
 }
 
 static bool identifiers_equal(token_t *a, token_t *b)
@@ -1335,7 +1414,7 @@ obj_function_t *compile(const char *source)
 {
     init_scanner(source);
     compiler_t compiler;
-    init_compiler(&compiler, TYPE_SCRIPT);
+    init_compiler(&compiler, TYPE_SCRIPT, NULL);
 
     parser.panic_mode = false;
     parser.had_error = false;
@@ -1349,6 +1428,43 @@ obj_function_t *compile(const char *source)
     return parser.had_error ? NULL : function;
 }
 
+// Compiles a function skipped by the pre-parse. Nothing around it is
+// captured, so it is compiled on its own like a script; functions nested
+// in it may be skipped in turn. On an error the function stays lazy and
+// every call fails the same way.
+bool compile_lazy(obj_function_t *function)
+{
+    lazy_source_t *lazy = function->lazy;
+    init_scanner_at(lazy->source, lazy->line);
+    parser.panic_mode = false;
+    parser.had_error = false;
+
+    class_compiler_t class_compiler;
+    class_compiler.enclosing = NULL;
+    class_compiler.has_superclass = lazy->has_superclass;
+    current_class = lazy->in_class ? &class_compiler : NULL;
+
+    compiler_t compiler;
+    init_compiler(&compiler, (function_type_e)lazy->type, function);
+    begin_scope();
+    function->arity = 0;
+
+    advance();
+    parameters();
+    block();
+    end_compiler();
+    current_class = NULL;
+
+    if (parser.had_error) {
+        function->chunk.count = 0;
+        function->chunk.constants.count = 0;
+        return false;
+    }
+    function->lazy = NULL;
+    free_lazy_source(lazy);
+    return true;
+}
+
 void mark_compiler_roots(void)
 {
     compiler_t *compiler = current;
@@ -4,6 +4,7 @@
 #include "object.h"
 
 obj_function_t *compile(const char *source);
+bool compile_lazy(obj_function_t *function);
 void mark_compiler_roots(void);
 
 #endif
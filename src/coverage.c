@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coverage.h"
+#include "debug.h"
+#include "heap.h"
+#include "object.h"
+
+// Lines of functions that were freed before the report, folded in by
+// forget_hits()
+static uint64_t *line_runs = NULL; // The most any instruction of the line ran
+static uint64_t *line_instructions = NULL; // Instructions executed on the line
+static bool *line_has_code = NULL;
+static int line_capacity = 0;
+
+static obj_function_t **functions = NULL; // Collected for the report
+static int function_count = 0;
+static int function_capacity = 0;
+
+void record_hit(chunk_t *chunk, int offset)
+{
+    if (chunk->hits == NULL) {
+        chunk->hits = (uint64_t*)calloc((size_t)chunk->count, sizeof(uint64_t));
+        if (chunk->hits == NULL) exit(1);
+    }
+    chunk->hits[offset]++;
+}
+
+static void grow_lines(int line)
+{
+    if (line < line_capacity) return;
+
+    int capacity = line_capacity < 64 ? 64 : line_capacity;
+    while (capacity <= line) capacity *= 2;
+
+    line_runs = (uint64_t*)realloc(line_runs, sizeof(uint64_t) * capacity);
+    line_instructions = (uint64_t*)realloc(line_instructions, sizeof(uint64_t) * capacity);
+    line_has_code = (bool*)realloc(line_has_code, sizeof(bool) * capacity);
+    if (line_runs == NULL || line_instructions == NULL || line_has_code == NULL) exit(1);
+
+    for (int i = line_capacity; i < capacity; i++) {
+        line_runs[i] = 0;
+        line_instructions[i] = 0;
+        line_has_code[i] = false;
+    }
+    line_capacity = capacity;
+}
+
+static void add_lines(chunk_t *chunk)
+{
+    for (int offset = 0; offset < chunk->count; offset++) {
+        int line = chunk->lines[offset];
+        uint64_t hits = chunk->hits != NULL ? chunk->hits[offset] : 0;
+        grow_lines(line);
+        line_has_code[line] = true;
+        line_instructions[line] += hits;
+        if (hits > line_runs[line]) line_runs[line] = hits;
+    }
+}
+
+void forget_hits(chunk_t *chunk)
+{
+    add_lines(chunk);
+    free(chunk->hits);
+    chunk->hits = NULL;
+}
+
+static void collect_function(obj_t *object)
+{
+    if (object->type != OBJ_FUNCTION) return;
+
+    if (function_capacity < function_count + 1) {
+        function_capacity = function_capacity < 64 ? 64 : function_capacity * 2;
+        functions = (obj_function_t**)realloc(functions, sizeof(obj_function_t*) * function_capacity);
+        if (functions == NULL) exit(1);
+    }
+    functions[function_count++] = (obj_function_t*)object;
+}
+
+// In source order
+static int compare_functions(const void *a, const void *b)
+{
+    chunk_t *left = &(*(obj_function_t* const*)a)->chunk;
+    chunk_t *right = &(*(obj_function_t* const*)b)->chunk;
+    int left_line = left->count > 0 ? left->lines[0] : 0;
+    int right_line = right->count > 0 ? right->lines[0] : 0;
+    return left_line - right_line;
+}
+
+static void write_source(FILE *file, const char *source)
+{
+    int lines = 0;
+    int lines_run = 0;
+    for (int line = 0; line < line_capacity; line++) {
+        if (!line_has_code[line]) continue;
+        lines++;
+        if (line_runs[line] > 0) lines_run++;
+    }
+    fprintf(file, "== source: %d of %d lines ran ==\n", lines_run, lines);
+    fprintf(file, "%10s %12s %5s\n", "runs", "instructions", "line");
+
+    int line = 1;
+    for (const char *start = source; *start != '\0'; line++) {
+        const char *end = strchr(start, '\n');
+        int length = end != NULL ? (int)(end - start) : (int)strlen(start);
+
+        if (line >= line_capacity || !line_has_code[line]) {
+            fprintf(file, "%10s %12s", "-", "-");
+        } else if (line_runs[line] == 0) {
+            fprintf(file, "%10s %12s", "#####", "0");
+        } else {
+            fprintf(file, "%10llu %12llu", (unsigned long long)line_runs[line],
+                    (unsigned long long)line_instructions[line]);
+        }
+        fprintf(file, " %5d: %.*s\n", line, length, start);
+
+        if (end == NULL) break;
+        start = end + 1;
+    }
+}
+
+static void write_function(FILE *file, obj_function_t *function)
+{
+    chunk_t *chunk = &function->chunk;
+    fprintf(file, "\n== %s (line %d) ==\n",
+            function->name != NULL ? function->name->chars : "<script>",
+            chunk->count > 0 ? chunk->lines[0] : 0);
+
+    for (int offset = 0; offset < chunk->count;) {
+        uint64_t hits = chunk->hits != NULL ? chunk->hits[offset] : 0;
+        if (hits > 0) {
+            fprintf(file, "%10llu ", (unsigned long long)hits);
+        } else {
+            fprintf(file, "%10s ", "#####");
+        }
+        offset = fprint_instruction(file, chunk, offset);
+    }
+}
+
+void write_coverage(FILE *file, const char *source)
+{
+    function_count = 0;
+    heap_visit_objects(collect_function);
+    qsort(functions, (size_t)function_count, sizeof(obj_function_t*), compare_functions);
+
+    for (int i = 0; i < function_count; i++) {
+        add_lines(&functions[i]->chunk);
+    }
+
+    if (source != NULL) write_source(file, source);
+    for (int i = 0; i < function_count; i++) {
+        write_function(file, functions[i]);
+    }
+
+    free(functions);
+    functions = NULL;
+    function_capacity = 0;
+}
@@ -0,0 +1,17 @@
+#ifndef CLOX_COVERAGE_H
+#define CLOX_COVERAGE_H
+
+#include <stdio.h>
+
+#include "chunk.h"
+
+// Execution counts for --coverage. While vm.coverage is set run() counts
+// every instruction it executes in chunk_t::hits. At exit they make an
+// annotated listing of the source, how often each line ran and how many
+// instructions it took, followed by the bytecode of every function with
+// the count of each instruction.
+void record_hit(chunk_t *chunk, int offset);
+void forget_hits(chunk_t *chunk);
+void write_coverage(FILE *file, const char *source);
+
+#endif
@@ -0,0 +1,194 @@
+#if defined(__unix__) || defined(__APPLE__)
+#define _XOPEN_SOURCE 700
+#define CPU_PROFILE_TIMER
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef CPU_PROFILE_TIMER
+#include <errno.h>
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+#include "cpu_profile.h"
+#include "vm.h"
+
+#define CPU_PROFILE_NAME_MAX 64 // Longer function names are cut
+
+// Only the signal handler writes to the buffer while the timer runs, the
+// program reads it once the timer is stopped
+static char *buffer = NULL;
+static size_t buffer_used = 0;
+static size_t dropped = 0; // Samples that didn't fit
+
+#ifdef CPU_PROFILE_TIMER
+static volatile sig_atomic_t is_held = 0;
+static struct sigaction previous_action;
+
+static bool append(size_t *length, const char *chars, size_t count)
+{
+    if (buffer_used + *length + count > CPU_PROFILE_BUFFER) return false;
+    memcpy(buffer + buffer_used + *length, chars, count);
+    *length += count;
+    return true;
+}
+
+static bool append_number(size_t *length, int number)
+{
+    char digits[16];
+    int count = 0;
+    unsigned value = number < 0 ? 0u : (unsigned)number;
+    do {
+        digits[sizeof(digits) - 1 - count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    return append(length, digits + sizeof(digits) - count, (size_t)count);
+}
+
+static bool append_frame(size_t *length, call_frame_t *frame)
+{
+    obj_function_t *function = frame->closure->function;
+    const char *name = "script";
+    size_t name_length = 6;
+    if (function->name != NULL) {
+        name = function->name->chars;
+        name_length = (size_t)function->name->length;
+        if (name_length > CPU_PROFILE_NAME_MAX) name_length = CPU_PROFILE_NAME_MAX;
+    }
+
+    size_t instruction = frame->ip > function->chunk.code
+        ? (size_t)(frame->ip - function->chunk.code - 1) : 0;
+    return append(length, name, name_length) &&
+           append(length, ":", 1) &&
+           append_number(length, function->chunk.lines[instruction]);
+}
+
+// Only reads the VM: call() fills in a frame before counting it, and
+// objects that a compaction is moving are left alone
+static void on_tick(int signal)
+{
+    (void)signal;
+    int saved_errno = errno;
+    size_t length = 0;
+    bool is_complete;
+
+    if (is_held) {
+        is_complete = append(&length, "(compacting)", 12);
+    } else if (vm.frame_count == 0) {
+        is_complete = append(&length, "(vm)", 4);
+    } else {
+        is_complete = true;
+        int frame_count = vm.frame_count;
+        for (int i = 0; i < frame_count && is_complete; i++) {
+            is_complete = (i == 0 || append(&length, ";", 1)) &&
+                          append_frame(&length, &vm.frames[i]);
+        }
+    }
+
+    if (is_complete && append(&length, "\n", 1)) {
+        buffer_used += length;
+    } else {
+        dropped++;
+    }
+    errno = saved_errno;
+}
+
+static void set_timer(int hz)
+{
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = hz > 0 ? 1000000 / hz : 0;
+    if (hz > 0 && timer.it_interval.tv_usec == 0) timer.it_interval.tv_usec = 1;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+#endif
+
+bool start_cpu_profile(int hz)
+{
+#ifdef CPU_PROFILE_TIMER
+    buffer = (char*)malloc(CPU_PROFILE_BUFFER);
+    if (buffer == NULL) return false;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_tick;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, &previous_action) != 0) return false;
+
+    set_timer(hz);
+    return true;
+#else
+    (void)hz;
+    return false;
+#endif
+}
+
+void stop_cpu_profile(void)
+{
+#ifdef CPU_PROFILE_TIMER
+    if (buffer == NULL) return;
+    set_timer(0);
+    sigaction(SIGPROF, &previous_action, NULL);
+#endif
+}
+
+// Samples taken while held are charged to "(compacting)" instead of
+// walking objects that are being moved
+void cpu_profile_hold(bool hold)
+{
+#ifdef CPU_PROFILE_TIMER
+    is_held = hold;
+#else
+    (void)hold;
+#endif
+}
+
+static int compare_lines(const void *a, const void *b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Folded stacks, one distinct stack per line with the number of samples
+// that caught it. Consumes the buffer, so it runs once the profile stopped.
+void write_cpu_profile(FILE *file)
+{
+    if (buffer == NULL) return;
+
+    size_t line_count = 0;
+    for (size_t i = 0; i < buffer_used; i++) {
+        if (buffer[i] == '\n') line_count++;
+    }
+
+    char **lines = (char**)malloc(sizeof(char*) * (line_count > 0 ? line_count : 1));
+    if (lines == NULL) exit(1);
+    size_t count = 0;
+    char *start = buffer;
+    for (size_t i = 0; i < buffer_used; i++) {
+        if (buffer[i] != '\n') continue;
+        buffer[i] = '\0';
+        lines[count++] = start;
+        start = buffer + i + 1;
+    }
+
+    qsort(lines, count, sizeof(char*), compare_lines);
+    for (size_t i = 0; i < count;) {
+        size_t run = 1;
+        while (i + run < count && strcmp(lines[i], lines[i + run]) == 0) run++;
+        fprintf(file, "%s %zu\n", lines[i], run);
+        i += run;
+    }
+
+    if (dropped > 0) {
+        fprintf(stderr, "CPU profile buffer full, %zu samples were dropped.\n", dropped);
+    }
+
+    free(lines);
+    free(buffer);
+    buffer = NULL;
+    buffer_used = 0;
+}
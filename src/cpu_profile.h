@@ -0,0 +1,20 @@
+#ifndef CLOX_CPU_PROFILE_H
+#define CLOX_CPU_PROFILE_H
+
+#include <stdio.h>
+
+#include "common.h"
+
+// Sampling CPU profiler. A SIGPROF timer interrupts the program hz times
+// per second of CPU time and the handler appends the Lox call stack, in
+// folded form, to a buffer allocated up front. Nothing runs in between
+// the ticks, so a program that isn't profiled pays nothing.
+#define CPU_PROFILE_DEFAULT_HZ 1000
+#define CPU_PROFILE_BUFFER (8 * 1024 * 1024)
+
+bool start_cpu_profile(int hz);
+void stop_cpu_profile(void);
+void cpu_profile_hold(bool hold);
+void write_cpu_profile(FILE *file);
+
+#endif
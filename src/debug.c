@@ -6,6 +6,60 @@
 #include "object.h"
 #include "value.h"
 
+static const char *op_code_names[OP_CODE_COUNT] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_CONSTANT_16] = "OP_CONSTANT_16",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_POP] = "OP_POP",
+    [OP_DUP] = "OP_DUP",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_DEFINE_GLOBAL_16] = "OP_DEFINE_GLOBAL_16",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_SET_GLOBAL_16] = "OP_SET_GLOBAL_16",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_GET_GLOBAL_16] = "OP_GET_GLOBAL_16",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+    [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+    [OP_GET_SUPER] = "OP_GET_SUPER",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_MODULUS] = "OP_MODULUS",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_CALL] = "OP_CALL",
+    [OP_INVOKE] = "OP_INVOKE",
+    [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+    [OP_CLASS] = "OP_CLASS",
+    [OP_INHERIT] = "OP_INHERIT",
+    [OP_METHOD] = "OP_METHOD",
+    [OP_ARRAY] = "OP_ARRAY",
+    [OP_SET_INDEX] = "OP_SET_INDEX",
+    [OP_GET_INDEX] = "OP_GET_INDEX",
+    [OP_RETURN] = "OP_RETURN",
+};
+
+const char *op_code_name(uint8_t instruction)
+{
+    return instruction < OP_CODE_COUNT ? op_code_names[instruction] : "OP_UNKNOWN";
+}
+
 void dissasemble_chunk(chunk_t *chunk, const char *name)
 {
     printf("== %s ==\n", name);
@@ -15,183 +69,189 @@ void dissasemble_chunk(chunk_t *chunk, const char *name)
     }
 }
 
-static int constant_instruction(const char *name, chunk_t *chunk, int offset)
+static int constant_instruction(FILE *file, const char *name, chunk_t *chunk, int offset)
 {
     uint8_t constant = chunk->code[offset + 1];
-    printf("%-16s %4d '", name, constant);
-    print_value(chunk->constants.values[constant]);
-    printf("'\n");
+    fprintf(file, "%-16s %4d '", name, constant);
+    fprint_value(file, chunk->constants.values[constant]);
+    fprintf(file, "'\n");
     return offset + 2;
 }
 
-static int constant_16_instruction(const char *name, chunk_t *chunk, int offset)
+static int constant_16_instruction(FILE *file, const char *name, chunk_t *chunk, int offset)
 {
     uint16_t constant = (chunk->code[offset + 1] << 0) |
                    (chunk->code[offset + 2] << 8);
 
-    printf("%-16s %4d '", name, constant);
-    print_value(chunk->constants.values[constant]);
-    printf("'\n");
+    fprintf(file, "%-16s %4d '", name, constant);
+    fprint_value(file, chunk->constants.values[constant]);
+    fprintf(file, "'\n");
 
     return offset + 3;
 }
 
-static int invoke_instruction(const char *name, chunk_t *chunk, int offset)
+static int invoke_instruction(FILE *file, const char *name, chunk_t *chunk, int offset)
 {
     uint8_t constant = chunk->code[offset + 1];
     uint8_t arg_count = chunk->code[offset + 2];
-    printf("%-16s (%d args) %4d '", name, arg_count, constant);
-    print_value(chunk->constants.values[constant]);
-    printf("'\n");
+    fprintf(file, "%-16s (%d args) %4d '", name, arg_count, constant);
+    fprint_value(file, chunk->constants.values[constant]);
+    fprintf(file, "'\n");
     return offset + 3;
 }
 
-static int simple_instruction(const char *name, int offset)
+static int simple_instruction(FILE *file, const char *name, int offset)
 {
-    printf("%s\n", name);
+    fprintf(file, "%s\n", name);
     return offset + 1;
 }
 
-static int byte_instruction(const char *name, chunk_t *chunk, int offset)
+static int byte_instruction(FILE *file, const char *name, chunk_t *chunk, int offset)
 {
     uint8_t slot = chunk->code[offset + 1];
-    printf("%-16s %4d\n", name, slot);
+    fprintf(file, "%-16s %4d\n", name, slot);
     return offset + 2;
 }
 
-static int jump_instruction(const char *name, int sign, chunk_t *chunk, int offset)
+static int jump_instruction(FILE *file, const char *name, int sign, chunk_t *chunk, int offset)
 {
     uint16_t jump = (chunk->code[offset + 1] << 0) |
                    (chunk->code[offset + 2] << 8);
-    printf("%-16s %4d -> %d\n", name, offset,
-           offset + 3 + sign * jump);
+    fprintf(file, "%-16s %4d -> %d\n", name, offset,
+            offset + 3 + sign * jump);
     return offset + 3;
 }
 
 int dissasemble_instruction(chunk_t *chunk, int offset)
 {
-    printf("%04d ", offset);
+    return fprint_instruction(stdout, chunk, offset);
+}
+
+int fprint_instruction(FILE *file, chunk_t *chunk, int offset)
+{
+    fprintf(file, "%04d ", offset);
     if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
-        printf("    | ");
+        fprintf(file, "    | ");
     } else {
-        printf(" %4d ", chunk->lines[offset]);
+        fprintf(file, " %4d ", chunk->lines[offset]);
     }
 
     uint8_t instruction = chunk->code[offset];
+    const char *name = op_code_name(instruction);
     switch (instruction) {
         case OP_CONSTANT:
-            return constant_instruction("OP_CONSTANT", chunk, offset);
+            return constant_instruction(file, name, chunk, offset);
         case OP_CONSTANT_16:
-            return constant_16_instruction("OP_CONSTANT_16", chunk, offset);
+            return constant_16_instruction(file, name, chunk, offset);
         case OP_NIL:
-            return simple_instruction("OP_NIL", offset);
+            return simple_instruction(file, name, offset);
         case OP_TRUE:
-            return simple_instruction("OP_TRUE", offset);
+            return simple_instruction(file, name, offset);
         case OP_FALSE:
-            return simple_instruction("OP_FALSE", offset);
+            return simple_instruction(file, name, offset);
         case OP_POP:
-            return simple_instruction("OP_POP", offset);
+            return simple_instruction(file, name, offset);
         case OP_DUP:
-            return simple_instruction("OP_DUP", offset);
+            return simple_instruction(file, name, offset);
         case OP_GET_LOCAL:
-            return byte_instruction("OP_GET_LOCAL", chunk, offset);
+            return byte_instruction(file, name, chunk, offset);
         case OP_SET_LOCAL:
-            return byte_instruction("OP_SET_LOCAL", chunk, offset);
+            return byte_instruction(file, name, chunk, offset);
         case OP_DEFINE_GLOBAL:
-            return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return constant_instruction(file, name, chunk, offset);
         case OP_DEFINE_GLOBAL_16:
-            return constant_16_instruction("OP_DEFINE_GLOBAL_16", chunk, offset);
+            return constant_16_instruction(file, name, chunk, offset);
         case OP_GET_GLOBAL:
-            return constant_instruction("OP_GET_GLOBAL", chunk, offset);
+            return constant_instruction(file, name, chunk, offset);
         case OP_GET_GLOBAL_16:
-            return constant_16_instruction("OP_GET_GLOBAL_16", chunk, offset);
+            return constant_16_instruction(file, name, chunk, offset);
         case OP_SET_GLOBAL:
-            return constant_instruction("OP_SET_GLOBAL", chunk, offset);
+            return constant_instruction(file, name, chunk, offset);
         case OP_SET_GLOBAL_16:
-            return constant_16_instruction("OP_SET_GLOBAL_16", chunk, offset);
+            return constant_16_instruction(file, name, chunk, offset);
         case OP_GET_UPVALUE:
-            return byte_instruction("OP_GET_UPVALUE", chunk, offset);
+            return byte_instruction(file, name, chunk, offset);
         case OP_SET_UPVALUE:
-            return byte_instruction("OP_SET_UPVALUE", chunk, offset);
+            return byte_instruction(file, name, chunk, offset);
         case OP_SET_PROPERTY:
-            return byte_instruction("OP_SET_PROPERTY", chunk, offset);
+            return byte_instruction(file, name, chunk, offset);
         case OP_GET_PROPERTY:
-            return byte_instruction("OP_GET_PROPERTY", chunk, offset);
+            return byte_instruction(file, name, chunk, offset);
         case OP_CLOSE_UPVALUE:
-            return simple_instruction("OP_CLOSE_UPVALUE", offset);
+            return simple_instruction(file, name, offset);
         case OP_EQUAL:
-            return simple_instruction("OP_EQUAL", offset);
+            return simple_instruction(file, name, offset);
         case OP_GET_SUPER:
-            return constant_instruction("OP_GET_SUPER", chunk, offset);
+            return constant_instruction(file, name, chunk, offset);
         case OP_GREATER:
-            return simple_instruction("OP_GREATER", offset);
+            return simple_instruction(file, name, offset);
         case OP_LESS:
-            return simple_instruction("OP_LESS", offset);
+            return simple_instruction(file, name, offset);
         case OP_ADD:
-            return simple_instruction("OP_ADD", offset);
+            return simple_instruction(file, name, offset);
         case OP_MODULUS:
-            return simple_instruction("OP_MODULUS", offset);
+            return simple_instruction(file, name, offset);
         case OP_SUBTRACT:
-            return simple_instruction("OP_SUBTRACT", offset);
+            return simple_instruction(file, name, offset);
         case OP_MULTIPLY:
-            return simple_instruction("OP_MULTIPLY", offset);
+            return simple_instruction(file, name, offset);
         case OP_DIVIDE:
-            return simple_instruction("OP_DIVIDE", offset);
+            return simple_instruction(file, name, offset);
         case OP_NOT:
-            return simple_instruction("OP_NOT", offset);
+            return simple_instruction(file, name, offset);
         case OP_NEGATE:
-            return simple_instruction("OP_NEGATE", offset);
+            return simple_instruction(file, name, offset);
         case OP_PRINT:
-            return simple_instruction("OP_PRINT", offset);
+            return simple_instruction(file, name, offset);
         case OP_JUMP:
-            return jump_instruction("OP_JUMP", 1, chunk, offset);
+            return jump_instruction(file, name, 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
-            return jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+            return jump_instruction(file, name, 1, chunk, offset);
         case OP_LOOP:
-            return jump_instruction("OP_LOOP", -1, chunk, offset);
+            return jump_instruction(file, name, -1, chunk, offset);
         case OP_ARRAY: {
             uint8_t count = chunk->code[offset + 1];
-            printf("%-16s %4d elements\n", "OP_ARRAY", count);
+            fprintf(file, "%-16s %4d elements\n", name, count);
             return offset + 2;
         }
         case OP_SET_INDEX:
-            return simple_instruction("OP_GET_INDEX", offset);
+            return simple_instruction(file, name, offset);
         case OP_GET_INDEX:
-            return simple_instruction("OP_SET_INDEX", offset);
+            return simple_instruction(file, name, offset);
         case OP_CALL:
-            return byte_instruction("OP_CALL", chunk, offset);
+            return byte_instruction(file, name, chunk, offset);
         case OP_INVOKE:
-            return invoke_instruction("OP_INVOKE", chunk, offset);
+            return invoke_instruction(file, name, chunk, offset);
         case OP_SUPER_INVOKE:
-            return invoke_instruction("OP_SUPER_INVOKE", chunk, offset);
+            return invoke_instruction(file, name, chunk, offset);
         case OP_CLOSURE: {
             offset++;
             uint8_t constant = chunk->code[offset++];
-            printf("%-16s %4d ", "OP_CLOSURE", constant);
-            print_value(chunk->constants.values[constant]);
-            printf("\n");
+            fprintf(file, "%-16s %4d ", name, constant);
+            fprint_value(file, chunk->constants.values[constant]);
+            fprintf(file, "\n");
 
             obj_function_t *function = AS_FUNCTION(
                 chunk->constants.values[constant]);
             for (int j = 0; j < function->upvalue_count; j++) {
                 int is_local = chunk->code[offset++];
                 int index = chunk->code[offset++];
-                printf("%04d    |                       %s %d\n",
+                fprintf(file, "%04d    |                       %s %d\n",
                        offset - 2, is_local ? "local" : "upvalue", index);
             }
 
             return offset;
         }
         case OP_CLASS:
-            return constant_instruction("OP_CLASS", chunk, offset);
+            return constant_instruction(file, name, chunk, offset);
         case OP_INHERIT:
-            return simple_instruction("OP_INHERIT", offset);
+            return simple_instruction(file, name, offset);
         case OP_METHOD:
-            return constant_instruction("OP_METHOD", chunk, offset);
+            return constant_instruction(file, name, chunk, offset);
         case OP_RETURN:
-            return simple_instruction("OP_RETURN", offset);
+            return simple_instruction(file, name, offset);
         default:
-            printf("Unknown opcode %d\n", offset);
+            fprintf(file, "Unknown opcode %d\n", offset);
             return offset + 1;
     }
 }
@@ -1,9 +1,13 @@
 #ifndef CLOX_DEBUG_H
 #define CLOX_DEBUG_H
 
+#include <stdio.h>
+
 #include "chunk.h"
 
+const char *op_code_name(uint8_t instruction);
 void dissasemble_chunk(chunk_t *chunk, const char *name);
 int dissasemble_instruction(chunk_t *chunk, int offset);
+int fprint_instruction(FILE *file, chunk_t *chunk, int offset);
 
 #endif
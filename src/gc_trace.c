@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "gc_trace.h"
+
+static const char *phase_names[GC_TRACE_PHASES] = {
+    "roots", "mark", "strings", "sweep", "compact",
+};
+
+// The program thread is the only writer. It fills the next slot and then
+// publishes it by bumping event_count, so it never waits for a reader.
+static gc_event_t events[GC_TRACE_EVENTS];
+static uint64_t event_count = 0; // Events ever finished
+static gc_event_t current;
+static bool is_recording = false; // A cycle is open in current
+static uint64_t cycle_count = 0;
+static uint64_t epoch = 0; // Start of the first cycle, times are relative to it
+static uint64_t pause_counts[GC_PAUSE_BUCKETS];
+
+void gc_trace_begin(const char *kind, uint64_t now, size_t bytes)
+{
+    // A cycle that was cut short (by a compaction) ends where the next starts
+    if (is_recording) gc_trace_end(now, bytes);
+    if (epoch == 0) epoch = now;
+
+    memset(&current, 0, sizeof(current));
+    current.number = ++cycle_count;
+    current.kind = kind;
+    current.start_ns = now - epoch;
+    current.bytes_before = bytes;
+    is_recording = true;
+}
+
+void gc_trace_end(uint64_t now, size_t bytes)
+{
+    if (!is_recording) return;
+    is_recording = false;
+
+    current.end_ns = now - epoch;
+    current.bytes_after = bytes;
+    events[event_count % GC_TRACE_EVENTS] = current;
+    STORE_RELEASE(event_count, event_count + 1);
+}
+
+void gc_trace_phase(gc_trace_phase_e phase, uint64_t ns)
+{
+    if (is_recording) current.phase_ns[phase] += ns;
+}
+
+void gc_trace_freed(obj_type_e type)
+{
+    if (is_recording) current.freed[type]++;
+}
+
+void gc_trace_pause(uint64_t ns)
+{
+    int bucket = 0;
+    for (uint64_t us = ns / 1000; us > 0 && bucket < GC_PAUSE_BUCKETS - 1; us >>= 1) {
+        bucket++;
+    }
+    pause_counts[bucket]++;
+
+    if (!is_recording) return;
+    current.pause_ns += ns;
+    current.pauses++;
+    if (ns > current.max_pause_ns) current.max_pause_ns = ns;
+}
+
+void gc_pause_histogram(uint64_t counts[GC_PAUSE_BUCKETS])
+{
+    memcpy(counts, pause_counts, sizeof(pause_counts));
+}
+
+// Copies the events still in the ring, oldest first. Slots the writer
+// reused while they were being copied are left out.
+static int read_events(gc_event_t *copy, uint64_t *dropped)
+{
+    uint64_t count = LOAD_ACQUIRE(event_count);
+    uint64_t first = count > GC_TRACE_EVENTS ? count - GC_TRACE_EVENTS : 0;
+    for (uint64_t i = first; i < count; i++) {
+        copy[i - first] = events[i % GC_TRACE_EVENTS];
+    }
+
+    uint64_t later = LOAD_ACQUIRE(event_count);
+    uint64_t valid = later > GC_TRACE_EVENTS ? later - GC_TRACE_EVENTS : 0;
+    if (valid > count) valid = count;
+    if (valid > first) {
+        memmove(copy, copy + (valid - first), sizeof(gc_event_t) * (count - valid));
+        first = valid;
+    }
+
+    *dropped = first;
+    return (int)(count - first);
+}
+
+static double micros(uint64_t ns)
+{
+    return (double)ns / 1000.0;
+}
+
+void gc_trace_write_json(FILE *file)
+{
+    static gc_event_t copy[GC_TRACE_EVENTS];
+    uint64_t dropped;
+    int count = read_events(copy, &dropped);
+
+    fprintf(file, "{\n  \"dropped\": %llu,\n  \"pause_histogram\": [",
+            (unsigned long long)dropped);
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        fprintf(file, "%s\n    {\"below_us\": ", i > 0 ? "," : "");
+        if (i < GC_PAUSE_BUCKETS - 1) {
+            fprintf(file, "%llu", 1ull << i);
+        } else {
+            fprintf(file, "null");
+        }
+        fprintf(file, ", \"count\": %llu}", (unsigned long long)pause_counts[i]);
+    }
+    fprintf(file, "\n  ],\n  \"cycles\": [");
+
+    for (int i = 0; i < count; i++) {
+        gc_event_t *event = &copy[i];
+        fprintf(file, "%s\n    {\"cycle\": %llu, \"kind\": \"%s\", \"start_us\": %.3f, "
+                      "\"end_us\": %.3f, \"pause_us\": %.3f, \"max_pause_us\": %.3f, \"pauses\": %d,\n",
+                i > 0 ? "," : "", (unsigned long long)event->number, event->kind,
+                micros(event->start_ns), micros(event->end_ns), micros(event->pause_ns),
+                micros(event->max_pause_ns), event->pauses);
+
+        fprintf(file, "     \"phases_us\": {");
+        for (int phase = 0; phase < GC_TRACE_PHASES; phase++) {
+            fprintf(file, "%s\"%s\": %.3f", phase > 0 ? ", " : "", phase_names[phase],
+                    micros(event->phase_ns[phase]));
+        }
+
+        fprintf(file, "},\n     \"bytes_before\": %zu, \"bytes_after\": %zu, \"freed\": {",
+                event->bytes_before, event->bytes_after);
+        for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+            fprintf(file, "%s\"%s\": %u", type > 0 ? ", " : "", object_type_name((obj_type_e)type),
+                    (unsigned)event->freed[type]);
+        }
+        fprintf(file, "}}");
+    }
+    fprintf(file, "\n  ]\n}\n");
+}
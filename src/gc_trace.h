@@ -0,0 +1,48 @@
+#ifndef CLOX_GC_TRACE_H
+#define CLOX_GC_TRACE_H
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+
+// GC telemetry. With vm.gc_trace set every collection cycle leaves an
+// event with its phase timings, heap sizes and freed objects in a ring of
+// the last GC_TRACE_EVENTS cycles. Pauses are always counted in a
+// histogram whose bucket i holds the ones shorter than 2^i microseconds,
+// the last bucket also takes all longer ones.
+#define GC_TRACE_EVENTS 256
+#define GC_PAUSE_BUCKETS 24
+
+typedef enum {
+    GC_TRACE_ROOTS,   // Graying the roots and remembered objects
+    GC_TRACE_MARK,    // Tracing, on the marker thread in concurrent mode
+    GC_TRACE_STRINGS, // Dropping unmarked strings from the intern table
+    GC_TRACE_SWEEP,   // Freeing, mostly spread over the allocations that follow
+    GC_TRACE_COMPACT, // Moving objects and forwarding references to them
+    GC_TRACE_PHASES,
+} gc_trace_phase_e;
+
+typedef struct {
+    uint64_t number;
+    const char *kind;
+    uint64_t start_ns;
+    uint64_t end_ns; // When the sweep finished
+    uint64_t phase_ns[GC_TRACE_PHASES];
+    uint64_t pause_ns; // Time the program was stopped for this cycle
+    uint64_t max_pause_ns;
+    int pauses;
+    size_t bytes_before;
+    size_t bytes_after;
+    uint32_t freed[OBJ_TYPE_COUNT];
+} gc_event_t;
+
+void gc_trace_begin(const char *kind, uint64_t now, size_t bytes);
+void gc_trace_end(uint64_t now, size_t bytes);
+void gc_trace_phase(gc_trace_phase_e phase, uint64_t ns);
+void gc_trace_freed(obj_type_e type);
+void gc_trace_pause(uint64_t ns);
+void gc_pause_histogram(uint64_t counts[GC_PAUSE_BUCKETS]);
+void gc_trace_write_json(FILE *file);
+
+#endif
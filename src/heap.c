@@ -0,0 +1,647 @@
+#ifdef __linux__
+#define _GNU_SOURCE // mremap
+#endif
+#define _POSIX_C_SOURCE 200112L
+#ifdef __APPLE__
+#define _DARWIN_C_SOURCE // MAP_ANON
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define HEAP_MMAP
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+#include "heap.h"
+#include "object.h"
+
+// Build with -DCLOX_SYSTEM_MALLOC=ON to give every object its own system
+// allocation, which keeps tools like valgrind and ASan precise.
+#ifdef SYSTEM_MALLOC
+#define USE_POOLS false
+#else
+#define USE_POOLS true
+#endif
+
+typedef struct {
+    heap_page_t *pages;
+    heap_page_t *current; // Pages before this one have no free cells
+} size_class_t;
+
+// Cursor of a sweep that runs in steps. Pages still flagged needs_sweep
+// are swept on demand before allocation takes a cell from them.
+typedef struct {
+    bool is_active;
+    heap_release_fn release;
+    bool keep_marks;
+    int class_index; // HEAP_CLASS_COUNT once the small pages are done
+    heap_page_t **link; // Next small page to visit
+    heap_page_t *large; // Next large page to visit
+} sweeper_t;
+
+// The VM is a single global driven by one thread, so the size classes are
+// effectively thread-local and need no locking.
+static size_class_t classes[HEAP_CLASS_COUNT];
+static heap_page_t *large_pages = NULL;
+static heap_page_t *evacuated_pages = NULL;
+static sweeper_t sweeper;
+
+static void sweep_page(heap_page_t *page, heap_release_fn release, bool release_all,
+                       bool keep_marks);
+
+static size_t cells_offset(int bitmap_words)
+{
+    size_t header = sizeof(heap_page_t) + 2 * sizeof(uint64_t) * bitmap_words;
+    return (header + 15) & ~(size_t)15;
+}
+
+// The bytes of a small or medium page that hold cells
+static size_t page_room(void)
+{
+    return HEAP_PAGE_SIZE - cells_offset(HEAP_BITMAP_WORDS);
+}
+
+static size_t medium_cell_size(int cells_per_page)
+{
+    return page_room() / (size_t)cells_per_page / HEAP_GRANULE * HEAP_GRANULE;
+}
+
+// The class of a cell that fits size bytes, -1 when it needs a page of its
+// own. A medium size goes to the class with the most cells per page whose
+// cells still fit it.
+static int size_class(size_t size)
+{
+    size_t granules = (size + HEAP_GRANULE - 1) / HEAP_GRANULE;
+    if (granules * HEAP_GRANULE <= HEAP_MAX_SMALL) return (int)granules - 1;
+
+    int cells_per_page = (int)(page_room() / (granules * HEAP_GRANULE));
+    if (cells_per_page < 2) return -1;
+    return HEAP_SIZE_CLASSES + cells_per_page - 2;
+}
+
+static size_t class_cell_size(int index)
+{
+    if (index < HEAP_SIZE_CLASSES) return (size_t)(index + 1) * HEAP_GRANULE;
+    return medium_cell_size(index - HEAP_SIZE_CLASSES + 2);
+}
+
+static int lowest_bit(uint64_t bits)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(bits);
+#else
+    int index = 0;
+    while ((bits & 1) == 0) {
+        bits >>= 1;
+        index++;
+    }
+    return index;
+#endif
+}
+
+static void *allocate_aligned(size_t size)
+{
+    void *memory;
+#ifdef _WIN32
+    memory = _aligned_malloc(size, HEAP_PAGE_SIZE);
+    if (memory == NULL) exit(1);
+#else
+    if (posix_memalign(&memory, HEAP_PAGE_SIZE, size) != 0) exit(1);
+#endif
+    return memory;
+}
+
+static void free_aligned(void *memory)
+{
+#ifdef _WIN32
+    _aligned_free(memory);
+#else
+    free(memory);
+#endif
+}
+
+#ifdef HEAP_MMAP
+static size_t round_to_os_pages(size_t size)
+{
+    static size_t os_page_size = 0;
+    if (os_page_size == 0) os_page_size = (size_t)sysconf(_SC_PAGESIZE);
+    return (size + os_page_size - 1) / os_page_size * os_page_size;
+}
+
+static void *map_memory(size_t size)
+{
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) exit(1);
+    return memory;
+}
+
+// Maps more than needed and trims it, so the page starts at a
+// HEAP_PAGE_SIZE boundary like every other page
+static void *map_aligned(size_t size)
+{
+    size_t padded = size + HEAP_PAGE_SIZE;
+    char *memory = (char*)map_memory(padded);
+    char *start = (char*)(((uintptr_t)memory + HEAP_PAGE_SIZE - 1) & ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+
+    if (start > memory) munmap(memory, (size_t)(start - memory));
+    size_t tail = (size_t)((memory + padded) - (start + size));
+    if (tail > 0) munmap(start + size, tail);
+    return start;
+}
+#endif
+
+static heap_page_t *new_page(size_t cell_size, int bitmap_words, size_t size)
+{
+    heap_page_t *page;
+    size_t map_size = 0;
+#ifdef HEAP_MMAP
+    if (size >= HEAP_MAP_THRESHOLD) {
+        map_size = round_to_os_pages(size);
+        page = (heap_page_t*)map_aligned(map_size);
+    } else
+#endif
+    {
+        page = (heap_page_t*)allocate_aligned(size);
+    }
+
+    page->map_size = map_size;
+    page->next = NULL;
+    page->prev = NULL;
+    page->cell_size = cell_size;
+    page->cell_count = 0;
+    page->live_count = 0;
+    page->bitmap_words = bitmap_words;
+    page->is_large = false;
+    page->needs_sweep = false;
+    page->is_evacuated = false;
+    page->free_list = NULL;
+    page->bump = NULL;
+    page->end = NULL;
+    for (int i = 0; i < 2 * bitmap_words; i++) {
+        page->bits[i] = 0;
+    }
+    return page;
+}
+
+static void free_page(heap_page_t *page)
+{
+#ifdef HEAP_MMAP
+    if (page->map_size > 0) {
+        munmap(page, page->map_size);
+        return;
+    }
+#endif
+    free_aligned(page);
+}
+
+static heap_page_t *add_small_page(size_class_t *klass, size_t cell_size)
+{
+    heap_page_t *page = new_page(cell_size, HEAP_BITMAP_WORDS, HEAP_PAGE_SIZE);
+    size_t offset = cells_offset(HEAP_BITMAP_WORDS);
+    page->cell_count = (int)((HEAP_PAGE_SIZE - offset) / cell_size);
+
+    // Fresh cells are handed out by bumping a pointer, the free list only
+    // collects cells released by the sweep
+    page->bump = (char*)page + offset;
+    page->end = page->bump + (size_t)page->cell_count * cell_size;
+
+    page->next = klass->pages;
+    klass->pages = page;
+    return page;
+}
+
+static void *allocate_large(size_t size)
+{
+    size_t offset = cells_offset(1);
+    heap_page_t *page = new_page(size, 1, offset + size);
+    page->cell_count = 1;
+    page->live_count = 1;
+    page->is_large = true;
+
+    page->next = large_pages;
+    if (large_pages != NULL) large_pages->prev = page;
+    large_pages = page;
+
+    void *cell = (char*)page + offset;
+    page->bits[0] = (uint64_t)1 << heap_cell_bit(page, cell);
+    return cell;
+}
+
+static void *allocate_cell(int index)
+{
+    size_class_t *klass = &classes[index];
+
+    heap_page_t *page = klass->current;
+    while (page != NULL) {
+        if (page->needs_sweep) {
+            sweep_page(page, sweeper.release, false, sweeper.keep_marks);
+        }
+        if (page->free_list != NULL || page->bump != page->end) break;
+        page = page->next;
+    }
+    if (page == NULL) {
+        page = add_small_page(klass, class_cell_size(index));
+    }
+    klass->current = page;
+
+    void *cell;
+    if (page->free_list != NULL) {
+        cell = page->free_list;
+        page->free_list = page->free_list->next;
+    } else {
+        cell = page->bump;
+        page->bump += page->cell_size;
+    }
+    page->live_count++;
+
+    size_t bit = heap_cell_bit(page, cell);
+    page->bits[bit / 64] |= (uint64_t)1 << (bit % 64);
+    return cell;
+}
+
+void *heap_allocate(size_t size)
+{
+    int index = USE_POOLS ? size_class(size) : -1;
+    return index >= 0 ? allocate_cell(index) : allocate_large(size);
+}
+
+// Small and medium pages that end up empty are released by the sweep,
+// large pages go back to the system right away.
+void heap_free(void *pointer, size_t size)
+{
+    (void)size;
+    if (pointer == NULL) return;
+
+    heap_page_t *page = heap_page_of(pointer);
+    size_t bit = heap_cell_bit(page, pointer);
+    page->bits[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+    page->live_count--;
+
+    if (page->is_large) {
+        if (page->prev != NULL) page->prev->next = page->next;
+        else large_pages = page->next;
+        if (page->next != NULL) page->next->prev = page->prev;
+        free_page(page);
+        return;
+    }
+
+    free_cell_t *cell = (free_cell_t*)pointer;
+    cell->next = page->free_list;
+    page->free_list = cell;
+}
+
+static void clear_marks(heap_page_t *page)
+{
+    memset(page->bits + page->bitmap_words, 0, sizeof(uint64_t) * page->bitmap_words);
+}
+
+// With keep_marks the marks of survivors stay set, which is how the
+// generational collector promotes them to the old generation.
+static void sweep_page(heap_page_t *page, heap_release_fn release, bool release_all,
+                       bool keep_marks)
+{
+    int bitmap_words = page->bitmap_words;
+    uint64_t *live = page->bits;
+    uint64_t *marks = page->bits + bitmap_words;
+    page->needs_sweep = false;
+
+    if (page->is_large) {
+        // Releasing the only cell frees the page itself
+        uint64_t dead = release_all ? live[0] : live[0] & ~marks[0];
+        if (dead != 0) {
+            release((obj_t*)((char*)page + lowest_bit(dead) * HEAP_GRANULE));
+        } else if (!keep_marks) {
+            clear_marks(page);
+        }
+        return;
+    }
+
+    for (int word = 0; word < bitmap_words; word++) {
+        uint64_t dead = release_all ? live[word] : live[word] & ~marks[word];
+        while (dead != 0) {
+            size_t bit = (size_t)word * 64 + lowest_bit(dead);
+            dead &= dead - 1;
+            release((obj_t*)((char*)page + bit * HEAP_GRANULE));
+        }
+    }
+
+    if (!keep_marks) clear_marks(page);
+}
+
+// Flags every page, so the sweep only ever touches pages that existed when
+// marking finished. Pages added afterwards only hold new objects.
+void heap_begin_sweep(heap_release_fn release, bool keep_marks)
+{
+    for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+        for (heap_page_t *page = classes[i].pages; page != NULL; page = page->next) {
+            page->needs_sweep = true;
+        }
+    }
+
+    for (heap_page_t *page = large_pages; page != NULL; page = page->next) {
+        page->needs_sweep = true;
+    }
+
+    sweeper.is_active = true;
+    sweeper.release = release;
+    sweeper.keep_marks = keep_marks;
+    sweeper.class_index = 0;
+    sweeper.link = &classes[0].pages;
+    sweeper.large = large_pages;
+}
+
+// Sweeps up to page_budget pages and returns true once every page is done
+bool heap_sweep_step(int page_budget)
+{
+    while (sweeper.is_active && page_budget > 0) {
+        if (sweeper.class_index < HEAP_CLASS_COUNT) {
+            size_class_t *klass = &classes[sweeper.class_index];
+            heap_page_t *page = *sweeper.link;
+
+            if (page == NULL) {
+                klass->current = klass->pages;
+                sweeper.class_index++;
+                if (sweeper.class_index < HEAP_CLASS_COUNT) {
+                    sweeper.link = &classes[sweeper.class_index].pages;
+                }
+                continue;
+            }
+
+            if (page->needs_sweep) {
+                sweep_page(page, sweeper.release, false, sweeper.keep_marks);
+                page_budget--;
+            }
+
+            if (page->live_count == 0 && page != klass->current) {
+                *sweeper.link = page->next;
+                free_aligned(page);
+            } else {
+                sweeper.link = &page->next;
+            }
+            continue;
+        }
+
+        heap_page_t *page = sweeper.large;
+        if (page == NULL) {
+            sweeper.is_active = false;
+            break;
+        }
+
+        sweeper.large = page->next;
+        if (page->needs_sweep) {
+            sweep_page(page, sweeper.release, false, sweeper.keep_marks);
+            page_budget--;
+        }
+    }
+
+    return !sweeper.is_active;
+}
+
+void heap_clear_marks(void)
+{
+    for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+        for (heap_page_t *page = classes[i].pages; page != NULL; page = page->next) {
+            clear_marks(page);
+        }
+    }
+
+    for (heap_page_t *page = large_pages; page != NULL; page = page->next) {
+        clear_marks(page);
+    }
+}
+
+// Counts the shared pages and how many of them a compaction would free
+void heap_fragmentation(int *page_count, int *reclaimable)
+{
+    *page_count = 0;
+    *reclaimable = 0;
+    for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+        int pages = 0;
+        int live_count = 0;
+        for (heap_page_t *page = classes[i].pages; page != NULL; page = page->next) {
+            pages++;
+            live_count += page->live_count;
+        }
+        if (pages == 0) continue;
+
+        int cell_count = classes[i].pages->cell_count;
+        int needed = (live_count + cell_count - 1) / cell_count;
+        *page_count += pages;
+        *reclaimable += pages - (needed > 0 ? needed : 1);
+    }
+}
+
+static int compare_live_count(const void *a, const void *b)
+{
+    const heap_page_t *left = *(heap_page_t* const*)a;
+    const heap_page_t *right = *(heap_page_t* const*)b;
+    return right->live_count - left->live_count;
+}
+
+static int evacuate_class(int class_index)
+{
+    size_class_t *klass = &classes[class_index];
+    int page_count = 0;
+    int live_count = 0;
+    for (heap_page_t *page = klass->pages; page != NULL; page = page->next) {
+        page_count++;
+        live_count += page->live_count;
+    }
+    if (page_count < 2) return 0;
+
+    int cell_count = klass->pages->cell_count;
+    int kept_count = (live_count + cell_count - 1) / cell_count;
+    if (kept_count == 0) kept_count = 1;
+    if (kept_count >= page_count) return 0;
+
+    // The fullest pages have room for everything, the others are emptied
+    heap_page_t **pages = (heap_page_t**)malloc(sizeof(heap_page_t*) * page_count);
+    if (pages == NULL) exit(1);
+    int index = 0;
+    for (heap_page_t *page = klass->pages; page != NULL; page = page->next) {
+        pages[index++] = page;
+    }
+    qsort(pages, (size_t)page_count, sizeof(heap_page_t*), compare_live_count);
+
+    klass->pages = NULL;
+    for (int i = kept_count - 1; i >= 0; i--) {
+        pages[i]->next = klass->pages;
+        klass->pages = pages[i];
+    }
+    klass->current = klass->pages;
+
+    int moved = 0;
+    for (int i = kept_count; i < page_count; i++) {
+        heap_page_t *page = pages[i];
+        page->is_evacuated = true;
+        page->next = evacuated_pages;
+        evacuated_pages = page;
+
+        for (int word = 0; word < page->bitmap_words; word++) {
+            uint64_t live = page->bits[word];
+            while (live != 0) {
+                size_t bit = (size_t)word * 64 + lowest_bit(live);
+                live &= live - 1;
+
+                void *cell = (char*)page + bit * HEAP_GRANULE;
+                void *copy = allocate_cell(class_index);
+                memcpy(copy, cell, page->cell_size);
+                *(void**)cell = copy;
+                moved++;
+            }
+        }
+    }
+
+    free(pages);
+    return moved;
+}
+
+// Moves the objects of sparse shared pages into the free cells of the
+// fullest pages of their size class. The heap has to be swept. The old
+// cells keep forwarding addresses (see heap_forward) until
+// heap_release_evacuated, large objects never move. Returns the number of
+// objects moved.
+int heap_evacuate(void)
+{
+    if (!USE_POOLS) return 0;
+
+    int moved = 0;
+    for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+        moved += evacuate_class(i);
+    }
+    return moved;
+}
+
+static void visit_page(heap_page_t *page, heap_visit_fn visit)
+{
+    for (int word = 0; word < page->bitmap_words; word++) {
+        uint64_t live = page->bits[word];
+        while (live != 0) {
+            size_t bit = (size_t)word * 64 + lowest_bit(live);
+            live &= live - 1;
+            visit((obj_t*)((char*)page + bit * HEAP_GRANULE));
+        }
+    }
+}
+
+// Calls visit for every object, evacuated pages excluded
+void heap_visit_objects(heap_visit_fn visit)
+{
+    for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+        for (heap_page_t *page = classes[i].pages; page != NULL; page = page->next) {
+            visit_page(page, visit);
+        }
+    }
+
+    for (heap_page_t *page = large_pages; page != NULL; page = page->next) {
+        visit_page(page, visit);
+    }
+}
+
+void heap_release_evacuated(void)
+{
+    while (evacuated_pages != NULL) {
+        heap_page_t *next = evacuated_pages->next;
+        free_aligned(evacuated_pages);
+        evacuated_pages = next;
+    }
+}
+
+#ifdef HEAP_MMAP
+static void *remap(void *pointer, size_t old_size, size_t new_size)
+{
+    size_t old_map = round_to_os_pages(old_size);
+    size_t new_map = round_to_os_pages(new_size);
+    if (new_map == old_map) return pointer;
+
+#ifdef __linux__
+    void *result = mremap(pointer, old_map, new_map, MREMAP_MAYMOVE);
+    if (result == MAP_FAILED) exit(1);
+    return result;
+#else
+    if (new_map < old_map) {
+        munmap((char*)pointer + new_map, old_map - new_map);
+        return pointer;
+    }
+    void *result = map_memory(new_map);
+    memcpy(result, pointer, old_size);
+    munmap(pointer, old_map);
+    return result;
+#endif
+}
+#endif
+
+// Resizes (or allocates or frees) a buffer that isn't a GC object, old_size
+// has to be the size it was allocated with. Buffers of HEAP_MAP_THRESHOLD
+// bytes or more get a mapping of their own, which grows without copying
+// where mremap exists and goes back to the system the moment it's freed.
+void *heap_resize_buffer(void *pointer, size_t old_size, size_t new_size)
+{
+#ifdef HEAP_MMAP
+    bool was_mapped = pointer != NULL && old_size >= HEAP_MAP_THRESHOLD;
+    bool is_mapped = new_size >= HEAP_MAP_THRESHOLD;
+
+    if (was_mapped && is_mapped) return remap(pointer, old_size, new_size);
+
+    if (was_mapped || is_mapped) {
+        void *result = NULL;
+        if (is_mapped) {
+            result = map_memory(round_to_os_pages(new_size));
+        } else if (new_size != 0) {
+            result = malloc(new_size);
+            if (result == NULL) exit(1);
+        }
+
+        if (pointer != NULL && result != NULL) {
+            memcpy(result, pointer, old_size < new_size ? old_size : new_size);
+        }
+        if (was_mapped) {
+            munmap(pointer, round_to_os_pages(old_size));
+        } else {
+            free(pointer);
+        }
+        return result;
+    }
+#else
+    (void)old_size;
+#endif
+
+    if (new_size == 0) {
+        free(pointer);
+        return NULL;
+    }
+
+    void *result = realloc(pointer, new_size);
+    if (result == NULL) exit(1);
+    return result;
+}
+
+void free_heap(heap_release_fn release)
+{
+    sweeper.is_active = false;
+
+    for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+        heap_page_t *page = classes[i].pages;
+        while (page != NULL) {
+            heap_page_t *next = page->next;
+            sweep_page(page, release, true, false);
+            free_aligned(page);
+            page = next;
+        }
+        classes[i].pages = NULL;
+        classes[i].current = NULL;
+    }
+
+    heap_page_t *page = large_pages;
+    while (page != NULL) {
+        heap_page_t *next = page->next;
+        sweep_page(page, release, true, false);
+        page = next;
+    }
+}
@@ -0,0 +1,117 @@
+#ifndef CLOX_HEAP_H
+#define CLOX_HEAP_H
+
+#include "common.h"
+#include "value.h"
+
+// GC objects live in HEAP_PAGE_SIZE aligned pages. Every page holds cells
+// of a single size class: multiples of HEAP_GRANULE up to HEAP_MAX_SMALL,
+// then medium cells that split a page into as many equal cells as fit, down
+// to two per page. Only objects bigger than half a page get a page of
+// their own. Two side bitmaps per page record
+// which cells hold an object and which of those were marked, so the sweep
+// is a linear scan over pages and marking never writes to the objects.
+#define HEAP_GRANULE 8
+#define HEAP_MAX_SMALL 256
+#define HEAP_SIZE_CLASSES (HEAP_MAX_SMALL / HEAP_GRANULE)
+// Medium classes by cells per page, from 2 to however many cells just over
+// HEAP_MAX_SMALL fit
+#define HEAP_MEDIUM_CLASSES (HEAP_PAGE_SIZE / (HEAP_MAX_SMALL + HEAP_GRANULE) - 1)
+#define HEAP_CLASS_COUNT (HEAP_SIZE_CLASSES + HEAP_MEDIUM_CLASSES)
+#define HEAP_PAGE_SIZE (16 * 1024)
+#define HEAP_BITMAP_WORDS (HEAP_PAGE_SIZE / HEAP_GRANULE / 64)
+// Large objects and buffers from this size on are mapped from the system
+// one by one and unmapped as soon as they die
+#define HEAP_MAP_THRESHOLD (64 * 1024)
+
+typedef struct free_cell_t {
+    struct free_cell_t *next;
+} free_cell_t;
+
+// Lives at the start of every page, so the page of any cell is found by
+// masking the cell address.
+typedef struct heap_page_t {
+    struct heap_page_t *next;
+    struct heap_page_t *prev; // Only kept for large pages
+    size_t cell_size;
+    int cell_count;
+    int live_count;
+    int bitmap_words;
+    bool is_large;
+    bool needs_sweep; // Not yet visited by the sweep in progress
+    bool is_evacuated; // Its objects were moved, each cell holds the new address
+    free_cell_t *free_list;
+    char *bump; // Never used cells of a small page start here
+    char *end;
+    size_t map_size; // Non-zero for pages mapped on their own
+    // One bit per granule where a cell starts: the live bitmap followed by
+    // the mark bitmap, bitmap_words each.
+    uint64_t bits[];
+} heap_page_t;
+
+typedef void (*heap_release_fn)(obj_t *object);
+typedef void (*heap_visit_fn)(obj_t *object);
+
+static inline heap_page_t *heap_page_of(void *cell)
+{
+    return (heap_page_t*)((uintptr_t)cell & ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+}
+
+static inline size_t heap_cell_bit(heap_page_t *page, void *cell)
+{
+    return (size_t)((char*)cell - (char*)page) / HEAP_GRANULE;
+}
+
+static inline bool heap_is_marked(obj_t *object)
+{
+    heap_page_t *page = heap_page_of(object);
+    size_t bit = heap_cell_bit(page, object);
+    uint64_t *marks = page->bits + page->bitmap_words;
+    return (marks[bit / 64] >> (bit % 64)) & 1;
+}
+
+static inline void heap_set_mark(obj_t *object)
+{
+    heap_page_t *page = heap_page_of(object);
+    size_t bit = heap_cell_bit(page, object);
+    uint64_t *marks = page->bits + page->bitmap_words;
+    marks[bit / 64] |= (uint64_t)1 << (bit % 64);
+}
+
+// Sets the mark and returns whether this call set it, so several threads
+// marking at once push every object exactly once
+static inline bool heap_try_mark(obj_t *object)
+{
+    heap_page_t *page = heap_page_of(object);
+    size_t bit = heap_cell_bit(page, object);
+    uint64_t *marks = page->bits + page->bitmap_words;
+    uint64_t mask = (uint64_t)1 << (bit % 64);
+#if defined(__GNUC__) || defined(__clang__)
+    return (__atomic_fetch_or(&marks[bit / 64], mask, __ATOMIC_RELAXED) & mask) == 0;
+#else
+    if (marks[bit / 64] & mask) return false;
+    marks[bit / 64] |= mask;
+    return true;
+#endif
+}
+
+// Where a compaction moved the object to, if it did
+static inline obj_t *heap_forward(obj_t *object)
+{
+    if (object == NULL || !heap_page_of(object)->is_evacuated) return object;
+    return *(obj_t**)object;
+}
+
+void *heap_allocate(size_t size);
+void heap_free(void *pointer, size_t size);
+void *heap_resize_buffer(void *pointer, size_t old_size, size_t new_size);
+void heap_begin_sweep(heap_release_fn release, bool keep_marks);
+bool heap_sweep_step(int page_budget);
+void heap_clear_marks(void);
+void heap_fragmentation(int *page_count, int *reclaimable);
+int heap_evacuate(void);
+void heap_visit_objects(heap_visit_fn visit);
+void heap_release_evacuated(void);
+void free_heap(heap_release_fn release);
+
+#endif
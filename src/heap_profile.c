@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap_profile.h"
+#include "heap.h"
+#include "vm.h"
+
+#define PROFILE_MAX_LOAD 0.75
+#define PROFILE_STACK_MAX 4096 // Longer stacks lose their innermost frames
+#define PROFILE_TYPE_ROOM 32 // Kept free for the type at the end of a stack
+
+#define TOMBSTONE ((obj_t*)1)
+
+// One distinct call stack and object type
+typedef struct {
+    char *stack; // Folded frames, outermost first, then the type
+    uint32_t hash;
+    size_t alloc_bytes;
+    size_t live_bytes;
+} heap_site_t;
+
+// A sampled object that is still alive
+typedef struct {
+    obj_t *object;
+    int site;
+    size_t bytes;
+} heap_sample_t;
+
+static size_t until_sample = 0; // Bytes to allocate before the next sample
+
+static heap_site_t *sites = NULL;
+static int site_count = 0;
+static int site_capacity = 0;
+static int *site_index = NULL; // Hash index of sites, -1 where empty
+static int site_index_capacity = 0;
+
+static heap_sample_t *samples = NULL;
+static int sample_count = 0; // Including tombstones
+static int sample_capacity = 0;
+
+static void *checked_realloc(void *pointer, size_t size)
+{
+    void *result = realloc(pointer, size);
+    if (result == NULL) exit(1);
+    return result;
+}
+
+static uint32_t hash_bytes(const char *bytes, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)bytes[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static uint32_t hash_pointer(obj_t *object)
+{
+    uint64_t bits = (uint64_t)(uintptr_t)object >> 3;
+    return (uint32_t)(bits ^ (bits >> 32)) * 2654435761u;
+}
+
+// The folded stack of the running Lox code, "script:3;make:12;string"
+static size_t fold_stack(char *buffer, obj_type_e type)
+{
+    size_t limit = PROFILE_STACK_MAX - PROFILE_TYPE_ROOM;
+    size_t length = 0;
+    if (vm.frame_count == 0) {
+        length = (size_t)snprintf(buffer, limit, "(vm);");
+    }
+
+    for (int i = 0; i < vm.frame_count && length < limit - 1; i++) {
+        call_frame_t *frame = &vm.frames[i];
+        obj_function_t *function = frame->closure->function;
+        size_t instruction = frame->ip > function->chunk.code
+            ? (size_t)(frame->ip - function->chunk.code - 1) : 0;
+        length += (size_t)snprintf(buffer + length, limit - length, "%s:%d;",
+                                   function->name == NULL ? "script" : function->name->chars,
+                                   function->chunk.lines[instruction]);
+    }
+    if (length > limit - 1) length = limit - 1;
+
+    length += (size_t)snprintf(buffer + length, PROFILE_TYPE_ROOM, "%s", object_type_name(type));
+    return length;
+}
+
+static void grow_site_index(void)
+{
+    site_index_capacity = site_index_capacity < 64 ? 64 : site_index_capacity * 2;
+    site_index = (int*)checked_realloc(site_index, sizeof(int) * site_index_capacity);
+    for (int i = 0; i < site_index_capacity; i++) site_index[i] = -1;
+
+    for (int i = 0; i < site_count; i++) {
+        uint32_t slot = sites[i].hash & (site_index_capacity - 1);
+        while (site_index[slot] != -1) slot = (slot + 1) & (site_index_capacity - 1);
+        site_index[slot] = i;
+    }
+}
+
+static int find_site(const char *stack, size_t length)
+{
+    if (site_count + 1 > site_index_capacity * PROFILE_MAX_LOAD) grow_site_index();
+
+    uint32_t hash = hash_bytes(stack, length);
+    uint32_t slot = hash & (site_index_capacity - 1);
+    for (; site_index[slot] != -1; slot = (slot + 1) & (site_index_capacity - 1)) {
+        heap_site_t *site = &sites[site_index[slot]];
+        if (site->hash == hash && strcmp(site->stack, stack) == 0) return site_index[slot];
+    }
+
+    if (site_capacity < site_count + 1) {
+        site_capacity = site_capacity < 64 ? 64 : site_capacity * 2;
+        sites = (heap_site_t*)checked_realloc(sites, sizeof(heap_site_t) * site_capacity);
+    }
+
+    heap_site_t *site = &sites[site_count];
+    memset(site, 0, sizeof(heap_site_t));
+    site->stack = (char*)checked_realloc(NULL, length + 1);
+    memcpy(site->stack, stack, length + 1);
+    site->hash = hash;
+    site_index[slot] = site_count;
+    return site_count++;
+}
+
+static heap_sample_t *find_sample(heap_sample_t *entries, int capacity, obj_t *object)
+{
+    uint32_t index = hash_pointer(object) & (capacity - 1);
+    heap_sample_t *tombstone = NULL;
+    for (;;) {
+        heap_sample_t *entry = &entries[index];
+        if (entry->object == NULL) return tombstone != NULL ? tombstone : entry;
+        if (entry->object == TOMBSTONE) {
+            if (tombstone == NULL) tombstone = entry;
+        } else if (entry->object == object) {
+            return entry;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+// Rebuilds the sample table, dropping tombstones. Objects a compaction
+// moved are entered at their new address.
+static void rehash_samples(int capacity)
+{
+    heap_sample_t *entries = (heap_sample_t*)calloc((size_t)capacity, sizeof(heap_sample_t));
+    if (entries == NULL) exit(1);
+
+    sample_count = 0;
+    for (int i = 0; i < sample_capacity; i++) {
+        heap_sample_t *entry = &samples[i];
+        if (entry->object == NULL || entry->object == TOMBSTONE) continue;
+
+        obj_t *object = heap_forward(entry->object);
+        heap_sample_t *dest = find_sample(entries, capacity, object);
+        *dest = *entry;
+        dest->object = object;
+        sample_count++;
+    }
+
+    free(samples);
+    samples = entries;
+    sample_capacity = capacity;
+}
+
+void heap_profile_allocation(obj_t *object, size_t size)
+{
+    size_t rate = vm.heap_profile_rate;
+    if (size < until_sample) {
+        until_sample -= size;
+        return;
+    }
+
+    // The sample stands for every stride of the rate this allocation crossed
+    size_t past = size - until_sample;
+    size_t bytes = (1 + past / rate) * rate;
+    until_sample = rate - past % rate;
+
+    char stack[PROFILE_STACK_MAX];
+    size_t length = fold_stack(stack, (obj_type_e)object->type);
+    int index = find_site(stack, length);
+    sites[index].alloc_bytes += bytes;
+    sites[index].live_bytes += bytes;
+
+    if (sample_count + 1 > sample_capacity * PROFILE_MAX_LOAD) {
+        rehash_samples(sample_capacity < 64 ? 64 : sample_capacity * 2);
+    }
+    heap_sample_t *sample = find_sample(samples, sample_capacity, object);
+    if (sample->object == NULL) sample_count++;
+    sample->object = object;
+    sample->site = index;
+    sample->bytes = bytes;
+    object->gc_bits |= GC_SAMPLED;
+}
+
+void heap_profile_free(obj_t *object)
+{
+    if (sample_capacity == 0) return;
+
+    heap_sample_t *sample = find_sample(samples, sample_capacity, object);
+    if (sample->object != object) return;
+
+    sites[sample->site].live_bytes -= sample->bytes;
+    sample->object = TOMBSTONE;
+}
+
+// Called after a compaction moved objects and before their old cells go
+void heap_profile_forward(void)
+{
+    if (sample_capacity > 0) rehash_samples(sample_capacity);
+}
+
+// Folded stacks under two roots: "alloc" weighs every site by the bytes
+// it ever allocated, "live" by those not freed yet.
+void heap_profile_write(FILE *file)
+{
+    for (int i = 0; i < site_count; i++) {
+        if (sites[i].alloc_bytes > 0) {
+            fprintf(file, "alloc;%s %zu\n", sites[i].stack, sites[i].alloc_bytes);
+        }
+    }
+    for (int i = 0; i < site_count; i++) {
+        if (sites[i].live_bytes > 0) {
+            fprintf(file, "live;%s %zu\n", sites[i].stack, sites[i].live_bytes);
+        }
+    }
+}
+
+void free_heap_profile(void)
+{
+    for (int i = 0; i < site_count; i++) {
+        free(sites[i].stack);
+    }
+    free(sites);
+    free(site_index);
+    free(samples);
+    sites = NULL;
+    site_index = NULL;
+    samples = NULL;
+    site_count = site_capacity = site_index_capacity = 0;
+    sample_count = sample_capacity = 0;
+}
@@ -0,0 +1,22 @@
+#ifndef CLOX_HEAP_PROFILE_H
+#define CLOX_HEAP_PROFILE_H
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+
+// Allocation-site heap profiler. While vm.heap_profile_rate is set, one
+// allocation out of every that many bytes is sampled together with the
+// Lox call stack it was made from, and stands for all the bytes since the
+// previous sample. Sampled objects carry GC_SAMPLED so their death can be
+// charged back to the site.
+#define HEAP_PROFILE_DEFAULT_RATE (512 * 1024)
+
+void heap_profile_allocation(obj_t *object, size_t size);
+void heap_profile_free(obj_t *object);
+void heap_profile_forward(void);
+void heap_profile_write(FILE *file);
+void free_heap_profile(void);
+
+#endif
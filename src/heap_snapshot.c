@@ -0,0 +1,296 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap_snapshot.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+#define SNAPSHOT_MAX_LOAD 0.75
+#define SNAPSHOT_STRING_PREFIX 40 // Characters of a string that go into its node
+
+typedef struct {
+    obj_t *object;
+    int id;
+} snapshot_entry_t;
+
+// Objects get an id when the walk first reaches them and are written
+// once they come off the work stack
+typedef struct {
+    FILE *file;
+    snapshot_entry_t *entries;
+    int count;
+    int capacity;
+    obj_t **stack;
+    int stack_count;
+    int stack_capacity;
+    bool is_first_edge;
+} snapshot_t;
+
+static uint32_t hash_pointer(obj_t *object)
+{
+    uint64_t bits = (uint64_t)(uintptr_t)object >> 3;
+    return (uint32_t)(bits ^ (bits >> 32)) * 2654435761u;
+}
+
+static snapshot_entry_t *find_entry(snapshot_entry_t *entries, int capacity, obj_t *object)
+{
+    uint32_t index = hash_pointer(object) & (capacity - 1);
+    while (entries[index].object != NULL && entries[index].object != object) {
+        index = (index + 1) & (capacity - 1);
+    }
+    return &entries[index];
+}
+
+static void grow_entries(snapshot_t *snapshot)
+{
+    int capacity = snapshot->capacity < 64 ? 64 : snapshot->capacity * 2;
+    snapshot_entry_t *entries = (snapshot_entry_t*)calloc((size_t)capacity, sizeof(snapshot_entry_t));
+    if (entries == NULL) exit(1);
+
+    for (int i = 0; i < snapshot->capacity; i++) {
+        if (snapshot->entries[i].object == NULL) continue;
+        *find_entry(entries, capacity, snapshot->entries[i].object) = snapshot->entries[i];
+    }
+    free(snapshot->entries);
+    snapshot->entries = entries;
+    snapshot->capacity = capacity;
+}
+
+// The id of the object, queuing it the first time it is seen
+static int object_id(snapshot_t *snapshot, obj_t *object)
+{
+    if (snapshot->count + 1 > snapshot->capacity * SNAPSHOT_MAX_LOAD) grow_entries(snapshot);
+
+    snapshot_entry_t *entry = find_entry(snapshot->entries, snapshot->capacity, object);
+    if (entry->object != NULL) return entry->id;
+
+    entry->object = object;
+    entry->id = ++snapshot->count; // 0 is the root
+    if (snapshot->stack_capacity < snapshot->stack_count + 1) {
+        snapshot->stack_capacity = GROW_CAPACITY(snapshot->stack_capacity);
+        snapshot->stack = (obj_t**)realloc(snapshot->stack, sizeof(obj_t*) * snapshot->stack_capacity);
+        if (snapshot->stack == NULL) exit(1);
+    }
+    snapshot->stack[snapshot->stack_count++] = object;
+    return entry->id;
+}
+
+static void write_string(FILE *file, const char *chars, int length)
+{
+    fputc('"', file);
+    for (int i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)chars[i];
+        if (c == '"' || c == '\\') {
+            fprintf(file, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(file, "\\u%04x", c);
+        } else {
+            fputc(c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+static void begin_edge(snapshot_t *snapshot)
+{
+    fputs(snapshot->is_first_edge ? "[" : ", [", snapshot->file);
+    snapshot->is_first_edge = false;
+}
+
+static void edge(snapshot_t *snapshot, const char *name, obj_t *object)
+{
+    if (object == NULL) return;
+    begin_edge(snapshot);
+    write_string(snapshot->file, name, (int)strlen(name));
+    fprintf(snapshot->file, ", %d]", object_id(snapshot, object));
+}
+
+static void value_edge(snapshot_t *snapshot, const char *name, value_t value)
+{
+    if (IS_OBJ(value)) edge(snapshot, name, AS_OBJ(value));
+}
+
+// Values are named by their keys, object keys get an edge of their own
+static void table_edges(snapshot_t *snapshot, table_t *table)
+{
+    for (int i = 0; i < table->capacity; i++) {
+        entry_t *entry = &table->entries[i];
+        if (IS_NIL(entry->key)) continue;
+
+        if (IS_OBJ(entry->key)) edge(snapshot, "key", AS_OBJ(entry->key));
+        if (!IS_OBJ(entry->value)) continue;
+
+        begin_edge(snapshot);
+        if (IS_STRING(entry->key)) {
+            obj_string_t *key = AS_STRING(entry->key);
+            write_string(snapshot->file, key->chars, key->length);
+        } else if (IS_NUMBER(entry->key)) {
+            fprintf(snapshot->file, "\"%g\"", AS_NUMBER(entry->key));
+        } else {
+            fputs("\"value\"", snapshot->file);
+        }
+        fprintf(snapshot->file, ", %d]", object_id(snapshot, AS_OBJ(entry->value)));
+    }
+}
+
+// The object with the buffers it owns
+static size_t object_size(obj_t *object)
+{
+    switch ((obj_type_e)object->type) {
+        case OBJ_STRING:
+            return sizeof(obj_string_t) + ((obj_string_t*)object)->length + 1;
+        case OBJ_ARRAY:
+            return sizeof(obj_array_t) +
+                   sizeof(entry_t) * ((obj_array_t*)object)->elements.capacity;
+        case OBJ_NATIVE:
+            return sizeof(obj_native_t);
+        case OBJ_FUNCTION: {
+            chunk_t *chunk = &((obj_function_t*)object)->chunk;
+            return sizeof(obj_function_t) + (sizeof(uint8_t) + sizeof(int)) * chunk->capacity +
+                   sizeof(value_t) * chunk->constants.capacity;
+        }
+        case OBJ_CLOSURE:
+            return sizeof(obj_closure_t) +
+                   sizeof(obj_upvalue_t*) * ((obj_closure_t*)object)->upvalue_count;
+        case OBJ_UPVALUE:
+            return sizeof(obj_upvalue_t);
+        case OBJ_CLASS:
+            return sizeof(obj_class_t) + sizeof(entry_t) * ((obj_class_t*)object)->methods.capacity;
+        case OBJ_INSTANCE:
+            return sizeof(obj_instance_t) +
+                   sizeof(entry_t) * ((obj_instance_t*)object)->fields.capacity;
+        case OBJ_BOUND_METHOD:
+            return sizeof(obj_bound_method_t);
+    }
+    return 0;
+}
+
+static void write_node(snapshot_t *snapshot, int id, obj_t *object)
+{
+    FILE *file = snapshot->file;
+    fprintf(file, "{\"id\": %d, \"type\": \"%s\", \"size\": %zu", id,
+            object_type_name((obj_type_e)object->type), object_size(object));
+
+    switch ((obj_type_e)object->type) {
+        case OBJ_STRING: {
+            obj_string_t *string = (obj_string_t*)object;
+            fputs(", \"value\": ", file);
+            write_string(file, string->chars,
+                         string->length < SNAPSHOT_STRING_PREFIX ? string->length : SNAPSHOT_STRING_PREFIX);
+            break;
+        }
+        case OBJ_FUNCTION: {
+            obj_string_t *name = ((obj_function_t*)object)->name;
+            fputs(", \"name\": ", file);
+            if (name == NULL) fputs("\"script\"", file);
+            else write_string(file, name->chars, name->length);
+            break;
+        }
+        case OBJ_CLASS: {
+            obj_string_t *name = ((obj_class_t*)object)->name;
+            fputs(", \"name\": ", file);
+            write_string(file, name->chars, name->length);
+            break;
+        }
+        case OBJ_INSTANCE: {
+            obj_string_t *name = ((obj_instance_t*)object)->klass->name;
+            fputs(", \"class\": ", file);
+            write_string(file, name->chars, name->length);
+            break;
+        }
+        default:
+            break;
+    }
+
+    fputs(", \"edges\": [", file);
+    snapshot->is_first_edge = true;
+
+    switch ((obj_type_e)object->type) {
+        case OBJ_BOUND_METHOD: {
+            obj_bound_method_t *bound = (obj_bound_method_t*)object;
+            value_edge(snapshot, "receiver", bound->receiver);
+            edge(snapshot, "method", (obj_t*)bound->method);
+            break;
+        }
+        case OBJ_CLOSURE: {
+            obj_closure_t *closure = (obj_closure_t*)object;
+            edge(snapshot, "function", (obj_t*)closure->function);
+            for (int i = 0; i < closure->upvalue_count; i++) {
+                edge(snapshot, "upvalue", (obj_t*)closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_FUNCTION: {
+            obj_function_t *function = (obj_function_t*)object;
+            edge(snapshot, "name", (obj_t*)function->name);
+            for (int i = 0; i < function->chunk.constants.count; i++) {
+                value_edge(snapshot, "constant", function->chunk.constants.values[i]);
+            }
+            break;
+        }
+        case OBJ_UPVALUE:
+            value_edge(snapshot, "closed", ((obj_upvalue_t*)object)->closed);
+            break;
+        case OBJ_CLASS: {
+            obj_class_t *klass = (obj_class_t*)object;
+            edge(snapshot, "name", (obj_t*)klass->name);
+            table_edges(snapshot, &klass->methods);
+            break;
+        }
+        case OBJ_INSTANCE: {
+            obj_instance_t *instance = (obj_instance_t*)object;
+            edge(snapshot, "class", (obj_t*)instance->klass);
+            table_edges(snapshot, &instance->fields);
+            break;
+        }
+        case OBJ_ARRAY:
+            table_edges(snapshot, &((obj_array_t*)object)->elements);
+            break;
+        case OBJ_NATIVE:
+        case OBJ_STRING:
+            break;
+    }
+    fputs("]}\n", file);
+}
+
+// The same roots mark_roots() starts from
+static void write_roots(snapshot_t *snapshot)
+{
+    fputs("{\"id\": 0, \"type\": \"root\", \"size\": 0, \"edges\": [", snapshot->file);
+    snapshot->is_first_edge = true;
+
+    for (value_t *slot = vm.stack; slot < vm.stack_top; slot++) {
+        value_edge(snapshot, "stack", *slot);
+    }
+    for (int i = 0; i < vm.frame_count; i++) {
+        edge(snapshot, "frame", (obj_t*)vm.frames[i].closure);
+    }
+    for (obj_upvalue_t *upvalue = vm.open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+        edge(snapshot, "open upvalue", (obj_t*)upvalue);
+    }
+    table_edges(snapshot, &vm.globals);
+    edge(snapshot, "init string", (obj_t*)vm.init_string);
+    fputs("]}\n", snapshot->file);
+}
+
+bool write_heap_snapshot(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL) return false;
+
+    snapshot_t snapshot = {0};
+    snapshot.file = file;
+    write_roots(&snapshot);
+
+    while (snapshot.stack_count > 0) {
+        obj_t *object = snapshot.stack[--snapshot.stack_count];
+        write_node(&snapshot, find_entry(snapshot.entries, snapshot.capacity, object)->id, object);
+    }
+
+    free(snapshot.entries);
+    free(snapshot.stack);
+    return fclose(file) == 0;
+}
@@ -0,0 +1,14 @@
+#ifndef CLOX_HEAP_SNAPSHOT_H
+#define CLOX_HEAP_SNAPSHOT_H
+
+#include "common.h"
+
+// Writes every object reachable from the VM roots as JSON lines, one node
+// per line: {"id", "type", "size", "edges": [[name, id], ...]} plus the
+// class of instances, the name of functions and classes and the start of
+// strings. Node 0 is the synthetic root whose edges are the VM roots, so
+// dominators and retained sizes can be computed from it (see
+// tools/heap_summary.py).
+bool write_heap_snapshot(const char *path);
+
+#endif
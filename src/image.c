@@ -0,0 +1,618 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "image.h"
+#include "memory.h"
+#include "object.h"
+#include "serial.h"
+#include "table.h"
+#include "vm.h"
+
+#define IMAGE_MAX_LOAD 0.75
+#define IMAGE_NO_OBJECT 0 // Ids start at 1
+#define IMAGE_NAME_MAX 64
+
+typedef enum {
+    VALUE_NIL,
+    VALUE_FALSE,
+    VALUE_TRUE,
+    VALUE_NUMBER,
+    VALUE_OBJECT,
+} value_tag_e;
+
+// Objects are written, and created by the loader, in this order. Creating
+// an object only needs objects of the types before it: a class its name,
+// a closure its function, an instance its class.
+static const obj_type_e section_order[] = {
+    OBJ_STRING, OBJ_FUNCTION, OBJ_NATIVE, OBJ_CLASS, OBJ_UPVALUE,
+    OBJ_CLOSURE, OBJ_INSTANCE, OBJ_ARRAY, OBJ_BOUND_METHOD,
+};
+
+// Header: "LOXIMAGE", the format version, the opcode count and how many
+// objects and globals follow. A different byte order fails the version
+// check like in the bytecode cache.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t op_code_count;
+    uint32_t object_count;
+    uint32_t global_count;
+} image_header_t;
+
+typedef struct {
+    obj_t *object;
+    uint32_t id;
+} image_entry_t;
+
+// Every object reachable from the globals, in the order they were found
+// and then sorted into sections
+typedef struct {
+    image_entry_t *entries;
+    int count;
+    int capacity;
+    obj_t **objects;
+} image_writer_t;
+
+static uint32_t hash_pointer(obj_t *object)
+{
+    uint64_t bits = (uint64_t)(uintptr_t)object >> 3;
+    return (uint32_t)(bits ^ (bits >> 32)) * 2654435761u;
+}
+
+static image_entry_t *find_entry(image_entry_t *entries, int capacity, obj_t *object)
+{
+    uint32_t index = hash_pointer(object) & (capacity - 1);
+    while (entries[index].object != NULL && entries[index].object != object) {
+        index = (index + 1) & (capacity - 1);
+    }
+    return &entries[index];
+}
+
+static void grow_entries(image_writer_t *writer)
+{
+    int capacity = writer->capacity < 64 ? 64 : writer->capacity * 2;
+    image_entry_t *entries = (image_entry_t*)calloc((size_t)capacity, sizeof(image_entry_t));
+    obj_t **objects = (obj_t**)realloc(writer->objects, sizeof(obj_t*) * capacity);
+    if (entries == NULL || objects == NULL) exit(1);
+
+    for (int i = 0; i < writer->capacity; i++) {
+        if (writer->entries[i].object == NULL) continue;
+        *find_entry(entries, capacity, writer->entries[i].object) = writer->entries[i];
+    }
+    free(writer->entries);
+    writer->entries = entries;
+    writer->objects = objects;
+    writer->capacity = capacity;
+}
+
+static void collect_object(image_writer_t *writer, obj_t *object)
+{
+    if (object == NULL) return;
+    if (writer->count + 1 > writer->capacity * IMAGE_MAX_LOAD) grow_entries(writer);
+
+    image_entry_t *entry = find_entry(writer->entries, writer->capacity, object);
+    if (entry->object != NULL) return;
+    entry->object = object;
+    writer->objects[writer->count++] = object;
+}
+
+static void collect_value(image_writer_t *writer, value_t value)
+{
+    if (IS_OBJ(value)) collect_object(writer, AS_OBJ(value));
+}
+
+static void collect_table(image_writer_t *writer, table_t *table)
+{
+    for (int i = 0; i < table->capacity; i++) {
+        if (IS_NIL(table->entries[i].key)) continue;
+        collect_value(writer, table->entries[i].key);
+        collect_value(writer, table->entries[i].value);
+    }
+}
+
+// The objects list doubles as the work list, everything after i is still
+// to be visited. Images hold compiled code only, functions the pre-parse
+// skipped are compiled here.
+static bool collect_references(image_writer_t *writer)
+{
+    collect_table(writer, &vm.globals);
+    for (int i = 0; i < writer->count; i++) {
+        obj_t *object = writer->objects[i];
+        switch ((obj_type_e)object->type) {
+            case OBJ_STRING:
+            case OBJ_NATIVE:
+                break;
+            case OBJ_ARRAY:
+                collect_table(writer, &((obj_array_t*)object)->elements);
+                break;
+            case OBJ_FUNCTION: {
+                obj_function_t *function = (obj_function_t*)object;
+                if (function->lazy != NULL && !compile_lazy(function)) return false;
+                collect_object(writer, (obj_t*)function->name);
+                for (int j = 0; j < function->chunk.constants.count; j++) {
+                    collect_value(writer, function->chunk.constants.values[j]);
+                }
+                break;
+            }
+            case OBJ_CLOSURE: {
+                obj_closure_t *closure = (obj_closure_t*)object;
+                collect_object(writer, (obj_t*)closure->function);
+                for (int j = 0; j < closure->upvalue_count; j++) {
+                    collect_object(writer, (obj_t*)closure->upvalues[j]);
+                }
+                break;
+            }
+            case OBJ_UPVALUE:
+                collect_value(writer, *((obj_upvalue_t*)object)->location);
+                break;
+            case OBJ_CLASS: {
+                obj_class_t *klass = (obj_class_t*)object;
+                collect_object(writer, (obj_t*)klass->name);
+                collect_object(writer, (obj_t*)klass->initializer);
+                collect_table(writer, &klass->methods);
+                break;
+            }
+            case OBJ_INSTANCE: {
+                obj_instance_t *instance = (obj_instance_t*)object;
+                collect_object(writer, (obj_t*)instance->klass);
+                collect_table(writer, &instance->fields);
+                break;
+            }
+            case OBJ_BOUND_METHOD: {
+                obj_bound_method_t *bound = (obj_bound_method_t*)object;
+                collect_value(writer, bound->receiver);
+                collect_object(writer, (obj_t*)bound->method);
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+// Stable, so objects keep the order they were found in within a section
+static void sort_into_sections(image_writer_t *writer)
+{
+    obj_t **sorted = (obj_t**)malloc(sizeof(obj_t*) * (writer->count > 0 ? writer->count : 1));
+    if (sorted == NULL) exit(1);
+
+    uint32_t id = 0;
+    for (size_t i = 0; i < sizeof(section_order) / sizeof(section_order[0]); i++) {
+        for (int j = 0; j < writer->count; j++) {
+            obj_t *object = writer->objects[j];
+            if (object->type != section_order[i]) continue;
+            sorted[id++] = object;
+            find_entry(writer->entries, writer->capacity, object)->id = id;
+        }
+    }
+    free(writer->objects);
+    writer->objects = sorted;
+}
+
+static uint32_t id_of(image_writer_t *writer, obj_t *object)
+{
+    if (object == NULL) return IMAGE_NO_OBJECT;
+    return find_entry(writer->entries, writer->capacity, object)->id;
+}
+
+static void write_value(FILE *file, image_writer_t *writer, value_t value)
+{
+    if (IS_NIL(value)) {
+        fputc(VALUE_NIL, file);
+    } else if (IS_BOOL(value)) {
+        fputc(AS_BOOL(value) ? VALUE_TRUE : VALUE_FALSE, file);
+    } else if (IS_NUMBER(value)) {
+        fputc(VALUE_NUMBER, file);
+        write_double(file, AS_NUMBER(value));
+    } else {
+        fputc(VALUE_OBJECT, file);
+        write_u32(file, id_of(writer, AS_OBJ(value)));
+    }
+}
+
+static uint32_t live_entries(table_t *table)
+{
+    uint32_t count = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        if (!IS_NIL(table->entries[i].key)) count++;
+    }
+    return count;
+}
+
+static void write_table(FILE *file, image_writer_t *writer, table_t *table)
+{
+    write_u32(file, live_entries(table));
+    for (int i = 0; i < table->capacity; i++) {
+        if (IS_NIL(table->entries[i].key)) continue;
+        write_value(file, writer, table->entries[i].key);
+        write_value(file, writer, table->entries[i].value);
+    }
+}
+
+static bool write_object(FILE *file, image_writer_t *writer, obj_t *object)
+{
+    fputc(object->type, file);
+    switch ((obj_type_e)object->type) {
+        case OBJ_STRING: {
+            obj_string_t *string = (obj_string_t*)object;
+            write_counted(file, string->chars, (uint32_t)string->length);
+            break;
+        }
+        case OBJ_FUNCTION: {
+            obj_function_t *function = (obj_function_t*)object;
+            write_u32(file, (uint32_t)function->arity);
+            write_u32(file, (uint32_t)function->upvalue_count);
+            write_u32(file, id_of(writer, (obj_t*)function->name));
+            write_code(file, &function->chunk);
+            write_u32(file, (uint32_t)function->chunk.constants.count);
+            for (int i = 0; i < function->chunk.constants.count; i++) {
+                write_value(file, writer, function->chunk.constants.values[i]);
+            }
+            break;
+        }
+        case OBJ_NATIVE: {
+            const char *name = native_name(((obj_native_t*)object)->function);
+            if (name == NULL) return false;
+            write_counted(file, name, (uint32_t)strlen(name));
+            break;
+        }
+        case OBJ_CLASS: {
+            obj_class_t *klass = (obj_class_t*)object;
+            write_u32(file, id_of(writer, (obj_t*)klass->name));
+            write_u32(file, id_of(writer, (obj_t*)klass->initializer));
+            write_table(file, writer, &klass->methods);
+            break;
+        }
+        case OBJ_UPVALUE:
+            write_value(file, writer, *((obj_upvalue_t*)object)->location);
+            break;
+        case OBJ_CLOSURE: {
+            obj_closure_t *closure = (obj_closure_t*)object;
+            write_u32(file, id_of(writer, (obj_t*)closure->function));
+            write_u32(file, (uint32_t)closure->upvalue_count);
+            for (int i = 0; i < closure->upvalue_count; i++) {
+                write_u32(file, id_of(writer, (obj_t*)closure->upvalues[i]));
+            }
+            break;
+        }
+        case OBJ_INSTANCE: {
+            obj_instance_t *instance = (obj_instance_t*)object;
+            write_u32(file, id_of(writer, (obj_t*)instance->klass));
+            write_table(file, writer, &instance->fields);
+            break;
+        }
+        case OBJ_ARRAY:
+            write_table(file, writer, &((obj_array_t*)object)->elements);
+            break;
+        case OBJ_BOUND_METHOD: {
+            obj_bound_method_t *bound = (obj_bound_method_t*)object;
+            write_value(file, writer, bound->receiver);
+            write_u32(file, id_of(writer, (obj_t*)bound->method));
+            break;
+        }
+    }
+    return true;
+}
+
+static bool write_contents(FILE *file, void *data)
+{
+    image_writer_t *writer = (image_writer_t*)data;
+
+    image_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "LOXIMAGE", 8);
+    header.version = IMAGE_VERSION;
+    header.op_code_count = OP_CODE_COUNT;
+    header.object_count = (uint32_t)writer->count;
+    header.global_count = live_entries(&vm.globals);
+    fwrite(&header, sizeof(header), 1, file);
+
+    for (int i = 0; i < writer->count; i++) {
+        if (!write_object(file, writer, writer->objects[i])) return false;
+    }
+    for (int i = 0; i < vm.globals.capacity; i++) {
+        if (IS_NIL(vm.globals.entries[i].key)) continue;
+        write_value(file, writer, vm.globals.entries[i].key);
+        write_value(file, writer, vm.globals.entries[i].value);
+    }
+    return true;
+}
+
+// Every object found is reachable from the globals and objects only move
+// at safe points, so the list stays valid even when compiling a skipped
+// function runs the collector
+bool save_image(const char *path)
+{
+    image_writer_t writer = { NULL, 0, 0, NULL };
+    grow_entries(&writer);
+    bool is_saved = collect_references(&writer);
+    sort_into_sections(&writer);
+
+    if (is_saved) is_saved = write_file_atomically(path, write_contents, &writer);
+    free(writer.entries);
+    free(writer.objects);
+    return is_saved;
+}
+
+// The objects of the image being loaded, they are roots until the globals
+// point at them
+static obj_t **loaded;
+static uint32_t loaded_count;
+
+void mark_image_roots(void)
+{
+    for (uint32_t i = 0; i < loaded_count; i++) {
+        mark_object(loaded[i]);
+    }
+}
+
+// Only objects created before are valid, which also keeps the sections in
+// their order
+static obj_t *read_object(reader_t *reader, obj_type_e type, bool is_optional)
+{
+    uint32_t id = read_u32(reader);
+    if (id == IMAGE_NO_OBJECT && is_optional) return NULL;
+    if (id == IMAGE_NO_OBJECT || id > loaded_count || loaded[id - 1]->type != type) {
+        reader->failed = true;
+        return NULL;
+    }
+    return loaded[id - 1];
+}
+
+static value_t read_value(reader_t *reader)
+{
+    switch (read_u8(reader)) {
+        case VALUE_NIL: return NIL_VAL;
+        case VALUE_FALSE: return BOOL_VAL(false);
+        case VALUE_TRUE: return BOOL_VAL(true);
+        case VALUE_NUMBER: return NUMBER_VAL(read_double(reader));
+        case VALUE_OBJECT: {
+            uint32_t id = read_u32(reader);
+            if (id != IMAGE_NO_OBJECT && id <= loaded_count) return OBJ_VAL(loaded[id - 1]);
+            break;
+        }
+    }
+    reader->failed = true;
+    return NIL_VAL;
+}
+
+// Without checking ids, the first pass skips references to objects that
+// don't exist yet
+static void skip_values(reader_t *reader, uint32_t count)
+{
+    for (uint32_t i = 0; i < count && !reader->failed; i++) {
+        switch (read_u8(reader)) {
+            case VALUE_NIL:
+            case VALUE_FALSE:
+            case VALUE_TRUE:
+                break;
+            case VALUE_NUMBER:
+                read_double(reader);
+                break;
+            case VALUE_OBJECT:
+                read_u32(reader);
+                break;
+            default:
+                reader->failed = true;
+                break;
+        }
+    }
+}
+
+static void skip_code(reader_t *reader)
+{
+    read_bytes(reader, read_u32(reader));
+    uint32_t runs = read_u32(reader);
+    if (runs > (uint32_t)(reader->end - reader->at) / 8) reader->failed = true;
+    read_bytes(reader, (size_t)runs * 8);
+}
+
+// The entries of a table, each store followed by the barrier of the
+// object that owns the table
+static void read_table(reader_t *reader, table_t *table, obj_t *owner)
+{
+    uint32_t count = read_u32(reader);
+    for (uint32_t i = 0; i < count && !reader->failed; i++) {
+        value_t key = read_value(reader);
+        value_t value = read_value(reader);
+        if (reader->failed || IS_NIL(key)) break;
+        table_set(table, key, value);
+        write_barrier(owner);
+    }
+}
+
+static obj_t *create_native(reader_t *reader)
+{
+    uint32_t length = read_u32(reader);
+    const uint8_t *chars = read_bytes(reader, length);
+    if (chars == NULL || length >= IMAGE_NAME_MAX) return NULL;
+
+    char name[IMAGE_NAME_MAX];
+    memcpy(name, chars, length);
+    name[length] = '\0';
+    native_fn function = find_native(name);
+    if (function == NULL) {
+        fprintf(stderr, "The image uses the native '%s' this interpreter doesn't define.\n", name);
+        return NULL;
+    }
+    return (obj_t*)new_native(function);
+}
+
+// First pass: the object with only the fields it can't be created without,
+// the rest of the record is skipped
+static obj_t *create_object(reader_t *reader)
+{
+    switch (read_u8(reader)) {
+        case OBJ_STRING:
+            return (obj_t*)read_string(reader, read_u32(reader));
+        case OBJ_FUNCTION: {
+            uint32_t arity = read_u32(reader);
+            uint32_t upvalue_count = read_u32(reader);
+            read_u32(reader);
+            skip_code(reader);
+            skip_values(reader, read_u32(reader));
+            if (reader->failed || arity > UINT8_MAX || upvalue_count > UINT8_MAX + 1) return NULL;
+
+            obj_function_t *function = new_function();
+            function->arity = (int)arity;
+            function->upvalue_count = (int)upvalue_count;
+            return (obj_t*)function;
+        }
+        case OBJ_NATIVE:
+            return create_native(reader);
+        case OBJ_CLASS: {
+            obj_string_t *name = (obj_string_t*)read_object(reader, OBJ_STRING, false);
+            read_u32(reader);
+            skip_values(reader, read_u32(reader) * 2);
+            return reader->failed ? NULL : (obj_t*)new_class(name);
+        }
+        case OBJ_UPVALUE: {
+            skip_values(reader, 1);
+            if (reader->failed) return NULL;
+            obj_upvalue_t *upvalue = new_upvalue(NULL);
+            upvalue->location = &upvalue->closed;
+            return (obj_t*)upvalue;
+        }
+        case OBJ_CLOSURE: {
+            obj_function_t *function = (obj_function_t*)read_object(reader, OBJ_FUNCTION, false);
+            uint32_t count = read_u32(reader);
+            read_bytes(reader, (size_t)count * sizeof(uint32_t));
+            if (reader->failed || count != (uint32_t)function->upvalue_count) return NULL;
+            return (obj_t*)new_closure(function);
+        }
+        case OBJ_INSTANCE: {
+            obj_class_t *klass = (obj_class_t*)read_object(reader, OBJ_CLASS, false);
+            skip_values(reader, read_u32(reader) * 2);
+            return reader->failed ? NULL : (obj_t*)new_instance(klass);
+        }
+        case OBJ_ARRAY:
+            skip_values(reader, read_u32(reader) * 2);
+            return reader->failed ? NULL : (obj_t*)new_array();
+        case OBJ_BOUND_METHOD: {
+            value_t receiver = read_value(reader);
+            obj_closure_t *method = (obj_closure_t*)read_object(reader, OBJ_CLOSURE, false);
+            return reader->failed ? NULL : (obj_t*)new_bound_method(receiver, method);
+        }
+        default:
+            return NULL;
+    }
+}
+
+// Second pass: every object exists, the references between them are
+// filled in. Objects may have aged or been marked since the first pass,
+// so stores go through the write barrier.
+static bool fill_object(reader_t *reader, obj_t *object)
+{
+    if (read_u8(reader) != object->type) return false;
+
+    switch ((obj_type_e)object->type) {
+        case OBJ_STRING:
+        case OBJ_NATIVE:
+            read_bytes(reader, read_u32(reader));
+            break;
+        case OBJ_FUNCTION: {
+            obj_function_t *function = (obj_function_t*)object;
+            read_u32(reader);
+            read_u32(reader);
+            function->name = (obj_string_t*)read_object(reader, OBJ_STRING, true);
+            write_barrier(object);
+            if (!reader->failed && !read_code(reader, &function->chunk)) return false;
+
+            uint32_t count = read_u32(reader);
+            for (uint32_t i = 0; i < count && !reader->failed; i++) {
+                add_constant(&function->chunk, read_value(reader));
+                write_barrier(object);
+            }
+            break;
+        }
+        case OBJ_CLASS: {
+            obj_class_t *klass = (obj_class_t*)object;
+            read_u32(reader);
+            klass->initializer = (obj_closure_t*)read_object(reader, OBJ_CLOSURE, true);
+            write_barrier(object);
+            read_table(reader, &klass->methods, object);
+            break;
+        }
+        case OBJ_UPVALUE:
+            ((obj_upvalue_t*)object)->closed = read_value(reader);
+            write_barrier(object);
+            break;
+        case OBJ_CLOSURE: {
+            obj_closure_t *closure = (obj_closure_t*)object;
+            read_u32(reader);
+            read_u32(reader);
+            for (int i = 0; i < closure->upvalue_count; i++) {
+                closure->upvalues[i] = (obj_upvalue_t*)read_object(reader, OBJ_UPVALUE, false);
+            }
+            write_barrier(object);
+            break;
+        }
+        case OBJ_INSTANCE:
+            read_u32(reader);
+            read_table(reader, &((obj_instance_t*)object)->fields, object);
+            break;
+        case OBJ_ARRAY:
+            read_table(reader, &((obj_array_t*)object)->elements, object);
+            break;
+        case OBJ_BOUND_METHOD:
+            read_value(reader);
+            read_u32(reader);
+            break;
+    }
+    return !reader->failed;
+}
+
+static bool read_image(const uint8_t *bytes, size_t size)
+{
+    image_header_t header;
+    if (size < sizeof(header)) return false;
+    memcpy(&header, bytes, sizeof(header));
+    if (memcmp(header.magic, "LOXIMAGE", 8) != 0 || header.version != IMAGE_VERSION ||
+        header.op_code_count != OP_CODE_COUNT || header.object_count > size) {
+        return false;
+    }
+
+    reader_t reader = { bytes + sizeof(header), bytes + size, false };
+    loaded = (obj_t**)malloc(sizeof(obj_t*) * (header.object_count > 0 ? header.object_count : 1));
+    if (loaded == NULL) return false;
+
+    for (uint32_t i = 0; i < header.object_count; i++) {
+        obj_t *object = create_object(&reader);
+        if (object == NULL) return false;
+        loaded[loaded_count++] = object;
+    }
+
+    reader.at = bytes + sizeof(header);
+    for (uint32_t i = 0; i < header.object_count; i++) {
+        if (!fill_object(&reader, loaded[i])) return false;
+    }
+
+    // Checked before the first global is set, so a bad image leaves the
+    // globals as they were
+    reader_t globals = reader;
+    skip_values(&globals, header.global_count * 2);
+    if (globals.failed || globals.at != globals.end) return false;
+
+    for (uint32_t i = 0; i < header.global_count; i++) {
+        value_t key = read_value(&reader);
+        value_t value = read_value(&reader);
+        if (IS_NIL(key)) return false;
+        table_set(&vm.globals, key, value);
+    }
+    return true;
+}
+
+// False when the file is missing or isn't an image of this interpreter.
+// Objects of an image rejected halfway are left to the collector.
+bool load_image(const char *path)
+{
+    mapped_file_t file;
+    if (!map_file(path, &file)) return false;
+
+    bool is_loaded = read_image(file.bytes, file.size);
+    free(loaded);
+    loaded = NULL;
+    loaded_count = 0;
+    unmap_file(&file);
+    return is_loaded;
+}
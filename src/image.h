@@ -0,0 +1,20 @@
+#ifndef CLOX_IMAGE_H
+#define CLOX_IMAGE_H
+
+#include "common.h"
+
+#define IMAGE_VERSION 1
+
+// Heap images: every object reachable from the globals, written after a
+// script ran and loaded back before the next one, so a prelude that
+// builds classes and tables runs once instead of at every start.
+//
+// The file is a header, the objects grouped by type and the globals.
+// Objects refer to each other by id, the loader creates every object
+// first and fills in the references in a second pass. Natives are
+// stored by the name they were defined under.
+bool save_image(const char *path);
+bool load_image(const char *path);
+void mark_image_roots(void);
+
+#endif
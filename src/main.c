@@ -2,8 +2,33 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "bytecode.h"
+#include "compiler.h"
+#include "coverage.h"
+#include "cpu_profile.h"
+#include "gc_trace.h"
+#include "heap_profile.h"
+#include "heap_snapshot.h"
+#include "image.h"
+#include "opstats.h"
+#include "trace.h"
 #include "vm.h"
 
+static bool compile_only = false; // --compile: write the bytecode cache, don't run
+static bool use_bytecode = true;
+static const char *gc_trace_path = NULL;
+static const char *heap_profile_path = NULL;
+static const char *heap_snapshot_path = NULL;
+static const char *cpu_profile_path = NULL;
+static int cpu_profile_hz = CPU_PROFILE_DEFAULT_HZ;
+static const char *coverage_path = NULL;
+static char *coverage_source = NULL; // The script, kept for the annotated listing
+static double heap_profile_rate = HEAP_PROFILE_DEFAULT_RATE;
+static const char *trace_path = NULL;
+static double trace_buffer = TRACE_DEFAULT_BUFFER;
+static const char *image_path = NULL; // --image: loaded before the script runs
+static const char *save_image_path = NULL;
+
 static void repl(void)
 {
     char line[1024];
@@ -49,28 +74,325 @@ static char *read_file(const char *path)
     return buffer;
 }
 
-static void run_file(const char *path)
+static void compile_file(const char *path)
 {
     char *source = read_file(path);
-    interpret_result_e result = interpret(source);
+    char *cache_path = bytecode_path(path);
+    vm.lazy_compile = false; // The cache holds compiled code only
+    obj_function_t *function = compile(source);
+    if (function == NULL) exit(65);
+
+    if (cache_path == NULL || !write_bytecode(cache_path, function, source)) {
+        fprintf(stderr, "Could not write the bytecode cache for \"%s\".\n", path);
+        exit(74);
+    }
+    free(cache_path);
     free(source);
+}
+
+// Runs the script from its bytecode cache when there is one for this
+// source, see bytecode.h
+static void run_file(const char *path)
+{
+    char *source = read_file(path);
+    if (coverage_path != NULL) coverage_source = source;
+
+    obj_function_t *function = NULL;
+    if (use_bytecode) {
+        char *cache_path = bytecode_path(path);
+        if (cache_path != NULL) function = load_bytecode(cache_path, source);
+        free(cache_path);
+    }
+    interpret_result_e result = function != NULL ? interpret_function(function)
+                                                 : interpret(source);
+    if (coverage_path == NULL) free(source);
 
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+
+    if (save_image_path != NULL && !save_image(save_image_path)) {
+        fprintf(stderr, "Could not write the heap image to \"%s\".\n", save_image_path);
+        exit(74);
+    }
+}
+
+// Runs at exit, so a script that fails still leaves its trace
+static void write_gc_trace(void)
+{
+    FILE *file = fopen(gc_trace_path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write the GC trace to \"%s\".\n", gc_trace_path);
+        return;
+    }
+    gc_trace_write_json(file);
+    fclose(file);
+}
+
+// Runs before the heap is torn down or, when the script fails, at exit
+static void write_heap_profile(void)
+{
+    if (heap_profile_path == NULL) return;
+
+    FILE *file = fopen(heap_profile_path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write the heap profile to \"%s\".\n", heap_profile_path);
+    } else {
+        heap_profile_write(file);
+        fclose(file);
+    }
+    heap_profile_path = NULL;
+}
+
+// Like the heap profile, taken of whatever is still reachable at the end
+static void write_final_snapshot(void)
+{
+    if (heap_snapshot_path == NULL) return;
+
+    if (!write_heap_snapshot(heap_snapshot_path)) {
+        fprintf(stderr, "Could not write the heap snapshot to \"%s\".\n", heap_snapshot_path);
+    }
+    heap_snapshot_path = NULL;
+}
+
+static void write_final_cpu_profile(void)
+{
+    if (cpu_profile_path == NULL) return;
+    stop_cpu_profile();
+
+    FILE *file = fopen(cpu_profile_path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write the CPU profile to \"%s\".\n", cpu_profile_path);
+    } else {
+        write_cpu_profile(file);
+        fclose(file);
+    }
+    cpu_profile_path = NULL;
+}
+
+// The report goes to stderr, after whatever the program printed
+static void write_final_opstats(void)
+{
+    if (!vm.op_stats) return;
+    vm.op_stats = false;
+    write_opstats(stderr);
+}
+
+static void write_final_coverage(void)
+{
+    if (coverage_path == NULL) return;
+
+    FILE *file = fopen(coverage_path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write the coverage report to \"%s\".\n", coverage_path);
+    } else {
+        write_coverage(file, coverage_source);
+        fclose(file);
+    }
+    coverage_path = NULL;
+    free(coverage_source);
+    coverage_source = NULL;
+}
+
+static void write_final_trace(void)
+{
+    if (trace_path == NULL) return;
+    vm.tracing = false;
+
+    FILE *file = fopen(trace_path, "wb");
+    if (file == NULL || !write_trace(file)) {
+        fprintf(stderr, "Could not write the execution trace to \"%s\".\n", trace_path);
+    }
+    if (file != NULL) fclose(file);
+    trace_path = NULL;
+    free_trace();
+}
+
+// A number, optionally followed by K, M or G
+static bool parse_size(const char *text, double *size)
+{
+    char *end;
+    *size = strtod(text, &end);
+    if (end == text) return false;
+
+    switch (*end) {
+        case 'K': *size *= 1024; end++; break;
+        case 'M': *size *= 1024 * 1024; end++; break;
+        case 'G': *size *= 1024 * 1024 * 1024; end++; break;
+    }
+    return *end == '\0';
+}
+
+static bool set_pacer_option(const char *name, const char *text)
+{
+    double value;
+    return parse_size(text, &value) && set_gc_pacer(name, value);
+}
+
+// LOX_GC_TARGET, LOX_GC_LIMIT and LOX_GC_RATIO set the pacer before any
+// --gc-target, --gc-limit and --gc-ratio flags are applied, LOX_GC_TRACE
+// works like --gc-trace
+static void read_environment(void)
+{
+    gc_trace_path = getenv("LOX_GC_TRACE");
+
+    static const char *names[][2] = {
+        {"LOX_GC_TARGET", "target"},
+        {"LOX_GC_LIMIT", "limit"},
+        {"LOX_GC_RATIO", "ratio"},
+    };
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        const char *text = getenv(names[i][0]);
+        if (text != NULL && !set_pacer_option(names[i][1], text)) {
+            fprintf(stderr, "Invalid value \"%s\" for %s.\n", text, names[i][0]);
+            exit(64);
+        }
+    }
+}
+
+static bool parse_option(const char *option)
+{
+    if (strcmp(option, "--gc=full") == 0) {
+        vm.gc_mode = GC_FULL;
+    } else if (strcmp(option, "--gc=generational") == 0) {
+        vm.gc_mode = GC_GENERATIONAL;
+    } else if (strcmp(option, "--gc=incremental") == 0) {
+        vm.gc_mode = GC_INCREMENTAL;
+#ifdef GC_THREADS
+    } else if (strcmp(option, "--gc=concurrent") == 0) {
+        vm.gc_mode = GC_CONCURRENT;
+    } else if (strncmp(option, "--gc-threads=", 13) == 0) {
+        long threads = strtol(option + 13, NULL, 10);
+        if (threads <= 0 || threads > 256) return false;
+        vm.gc_threads = (int)threads;
+#endif
+    } else if (strncmp(option, "--gc-target=", 12) == 0) {
+        return set_pacer_option("target", option + 12);
+    } else if (strncmp(option, "--gc-limit=", 11) == 0) {
+        return set_pacer_option("limit", option + 11);
+    } else if (strncmp(option, "--gc-ratio=", 11) == 0) {
+        return set_pacer_option("ratio", option + 11);
+    } else if (strncmp(option, "--gc-trace=", 11) == 0) {
+        gc_trace_path = option + 11;
+    } else if (strncmp(option, "--heap-profile=", 15) == 0) {
+        heap_profile_path = option + 15;
+    } else if (strncmp(option, "--heap-profile-rate=", 20) == 0) {
+        return parse_size(option + 20, &heap_profile_rate) && heap_profile_rate >= 1;
+    } else if (strncmp(option, "--heap-snapshot=", 16) == 0) {
+        heap_snapshot_path = option + 16;
+    } else if (strncmp(option, "--cpu-profile=", 14) == 0) {
+        cpu_profile_path = option + 14;
+    } else if (strncmp(option, "--cpu-profile-hz=", 17) == 0) {
+        long hz = strtol(option + 17, NULL, 10);
+        if (hz <= 0 || hz > 100000) return false;
+        cpu_profile_hz = (int)hz;
+    } else if (strcmp(option, "--opstats") == 0) {
+        vm.op_stats = true;
+    } else if (strcmp(option, "--opstats=time") == 0) {
+        vm.op_stats = true;
+        vm.op_timing = true;
+    } else if (strncmp(option, "--coverage=", 11) == 0) {
+        coverage_path = option + 11;
+        vm.coverage = true;
+    } else if (strncmp(option, "--trace=", 8) == 0) {
+        trace_path = option + 8;
+    } else if (strncmp(option, "--trace-buffer=", 15) == 0) {
+        return parse_size(option + 15, &trace_buffer) && trace_buffer >= 1;
+    } else if (strcmp(option, "--compile") == 0) {
+        compile_only = true;
+    } else if (strcmp(option, "--lazy-compile") == 0) {
+        vm.lazy_compile = true;
+    } else if (strcmp(option, "--no-bytecode-cache") == 0) {
+        use_bytecode = false;
+    } else if (strncmp(option, "--image=", 8) == 0) {
+        image_path = option + 8;
+    } else if (strncmp(option, "--save-image=", 13) == 0) {
+        save_image_path = option + 13;
+    } else if (strcmp(option, "--gc-compact") == 0) {
+        vm.gc_compact = true;
+    } else if (strncmp(option, "--gc-pause=", 11) == 0) {
+        long microseconds = strtol(option + 11, NULL, 10);
+        if (microseconds <= 0) return false;
+        vm.gc_step_budget = (uint64_t)microseconds * 1000;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: clox [--gc=full|generational|incremental|concurrent] [--gc-compact]\n"
+                    "            [--gc-pause=us] [--gc-threads=n] [--gc-target=size]\n"
+                    "            [--gc-limit=size] [--gc-ratio=share] [--gc-trace=file]\n"
+                    "            [--heap-profile=file] [--heap-profile-rate=size]\n"
+                    "            [--heap-snapshot=file] [--cpu-profile=file] [--cpu-profile-hz=n]\n"
+                    "            [--opstats[=time]] [--coverage=file] [--trace=file]\n"
+                    "            [--trace-buffer=size] [--no-bytecode-cache] [--image=file]\n"
+                    "            [--save-image=file] [--lazy-compile] [path]\n"
+                    "       clox --compile path\n");
+    exit(64);
 }
 
 int main(int argc, const char **argv)
 {
     init_vm();
+    read_environment();
+
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (!parse_option(argv[arg])) usage();
+    }
+
+    if (gc_trace_path != NULL && *gc_trace_path != '\0') {
+        vm.gc_trace = true;
+        atexit(write_gc_trace);
+    }
+    if (heap_profile_path != NULL) {
+        vm.heap_profile_rate = (size_t)heap_profile_rate;
+        atexit(write_heap_profile);
+    }
+    if (heap_snapshot_path != NULL) atexit(write_final_snapshot);
+    if (cpu_profile_path != NULL) {
+        if (!start_cpu_profile(cpu_profile_hz)) {
+            fprintf(stderr, "Could not start the CPU profiler.\n");
+            exit(64);
+        }
+        atexit(write_final_cpu_profile);
+    }
+    if (vm.op_stats) atexit(write_final_opstats);
+    if (vm.coverage) atexit(write_final_coverage);
+    if (trace_path != NULL) {
+        if (!start_trace((size_t)trace_buffer)) {
+            fprintf(stderr, "Could not allocate the trace buffer.\n");
+            exit(64);
+        }
+        vm.tracing = true;
+        atexit(write_final_trace);
+    }
+    vm.instrumented = vm.op_stats || vm.coverage || vm.tracing;
+
+    if (image_path != NULL && !load_image(image_path)) {
+        fprintf(stderr, "Could not load the heap image \"%s\".\n", image_path);
+        exit(74);
+    }
 
-    if (argc == 1) {
+    if (compile_only) {
+        if (arg != argc - 1) usage();
+        compile_file(argv[arg]);
+    } else if (arg == argc && save_image_path == NULL) {
         repl();
-    } else if (argc == 2) {
-        run_file(argv[1]);
+    } else if (arg == argc - 1) {
+        run_file(argv[arg]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        usage();
     }
 
+    write_final_cpu_profile();
+    write_final_opstats();
+    write_final_coverage();
+    write_final_trace();
+    write_heap_profile();
+    write_final_snapshot();
     free_vm();
 }
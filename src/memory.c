@@ -1,6 +1,21 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef GC_THREADS
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#endif
 
 #include "memory.h"
+#include "cpu_profile.h"
+#include "gc_trace.h"
+#include "heap_profile.h"
+#include "heap.h"
+#include "image.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
@@ -12,11 +27,112 @@
 #endif
 
 #define GC_HEAP_GROW_FACTOR 2
+#define GC_NURSERY_SIZE (1024 * 1024)
+#define GC_STEP_SIZE (64 * 1024) // Incremental mode: bytes allocated between two steps
+#define GC_STEP_CHECK 64 // Objects blackened between two looks at the clock
+#define GC_STEP_PAGES 8 // Pages swept between two looks at the clock
+#define GC_PARALLEL_MIN (4 * 1024 * 1024) // Smaller heaps are marked by one thread
+#define GC_SHARE_THRESHOLD 64 // Private gray objects before a marker offers some
+#define GC_LAZY_PAGES 1 // Pages swept by every allocation while a sweep is pending
+#define GC_COMPACT_MIN_PAGES 64 // Fewer reclaimable pages never trigger a compaction
+#define GC_MIN_ROOM (64 * 1024) // Least room a soft heap limit leaves above the live heap
 
-void *reallocate(void *pointer, size_t old_size, size_t new_size)
+static bool cycle_is_major; // Whether the collection being swept was a major one
+
+// The pacer measures the period from one cycle start to the next
+static uint64_t gc_ns = 0; // Time spent collecting so far
+static size_t allocated_total = 0; // Bytes ever allocated
+static uint64_t cycles_started = 0;
+static uint64_t period_start = 0;
+static uint64_t period_gc_ns = 0;
+static size_t period_allocated = 0;
+static double allocation_rate = 0; // Bytes per nanosecond the program ran in the last period
+static uint64_t cycle_cost = 0; // Nanoseconds spent collecting in the last period
+#ifdef DEBUG_LOG_GC
+static size_t bytes_before_sweep;
+#endif
+
+// Buffers the concurrent marker may still be reading, freed once it's done
+typedef struct {
+    void *pointer;
+    size_t size;
+} deferred_buffer_t;
+
+static deferred_buffer_t *deferred = NULL;
+static int deferred_count = 0;
+static int deferred_capacity = 0;
+
+#ifdef GC_THREADS
+static pthread_t marker;
+static bool marker_is_done;
+static size_t marking_limit; // Heap size at which the program waits for the marker
+
+// One thread of a parallel mark. It pushes and pops its private stack
+// without locking and moves half of it to the shared stack whenever that
+// runs dry, which is where idle markers steal from.
+typedef struct {
+    pthread_t thread;
+    int count;
+    int capacity;
+    obj_t **stack;
+    pthread_mutex_t lock;
+    int shared_count;
+    int shared_capacity;
+    obj_t **shared;
+} mark_worker_t;
+
+static mark_worker_t *workers;
+static int worker_count;
+static int idle_workers;
+static __thread mark_worker_t *worker = NULL; // Set while a thread takes part in a parallel mark
+#endif
+
+#ifdef GC_THREADS
+// Collector threads take no signals, so the profiler's SIGPROF always
+// interrupts the program thread
+static void spawn_thread(pthread_t *thread, void *(*run)(void*), void *argument)
+{
+    sigset_t all;
+    sigset_t previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    int result = pthread_create(thread, NULL, run, argument);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (result != 0) exit(1);
+}
+#endif
+
+static bool marker_is_running(void)
+{
+    return vm.gc_mode == GC_CONCURRENT && vm.gc_phase == GC_MARKING;
+}
+
+static void defer_free(void *pointer, size_t size)
+{
+    if (deferred_capacity < deferred_count + 1) {
+        deferred_capacity = GROW_CAPACITY(deferred_capacity);
+        deferred = (deferred_buffer_t*)realloc(deferred, sizeof(deferred_buffer_t) * deferred_capacity);
+
+        if (deferred == NULL) exit(1);
+    }
+    deferred[deferred_count].pointer = pointer;
+    deferred[deferred_count].size = size;
+    deferred_count++;
+}
+
+static void free_deferred(void)
+{
+    for (int i = 0; i < deferred_count; i++) {
+        heap_resize_buffer(deferred[i].pointer, deferred[i].size, 0);
+    }
+    deferred_count = 0;
+}
+
+static void track_allocation(size_t old_size, size_t new_size)
 {
     vm.bytes_allocated += new_size - old_size;
     if (new_size > old_size) {
+        allocated_total += new_size - old_size;
 
 #ifdef DEBUG_STRESS_GC
         collect_garbage();
@@ -27,71 +143,142 @@ void *reallocate(void *pointer, size_t old_size, size_t new_size)
         }
 
     }
+}
+
+void *reallocate(void *pointer, size_t old_size, size_t new_size)
+{
+    track_allocation(old_size, new_size);
+
+    if (pointer != NULL && marker_is_running()) {
+        // The marker may be reading the old buffer, so it has to outlive the cycle
+        void *result = NULL;
+        if (new_size != 0) {
+            result = heap_resize_buffer(NULL, 0, new_size);
+            memcpy(result, pointer, old_size < new_size ? old_size : new_size);
+        }
+        defer_free(pointer, old_size);
+        return result;
+    }
+
+    return heap_resize_buffer(pointer, old_size, new_size);
+}
+
+static void sweep_lazily(int page_budget);
+
+// GC objects are only ever allocated or freed, never resized, so this
+// hands out cells from the size-class pools instead of calling realloc.
+void *reallocate_object(void *pointer, size_t old_size, size_t new_size)
+{
+    track_allocation(old_size, new_size);
     if (new_size == 0) {
-        free(pointer);
+        heap_free(pointer, old_size);
         return NULL;
     }
 
-    void *result = realloc(pointer, new_size);
-    if (result == NULL) exit(1);
-    return result;
+    // Incremental mode sweeps in its own steps
+    if (vm.gc_phase == GC_SWEEPING && vm.gc_mode != GC_INCREMENTAL) {
+        sweep_lazily(GC_LAZY_PAGES);
+    }
+    return heap_allocate(new_size);
 }
 
 static void free_object(obj_t *object)
 {
+    if (vm.gc_trace) gc_trace_freed((obj_type_e)object->type);
+    if (object->gc_bits & GC_SAMPLED) heap_profile_free(object);
+
 #ifdef DEBUG_LOG_GC
     printf("%p free type %d\n", (void*)object, object->type);
 #endif
 
-    switch (object->type) {
+    switch ((obj_type_e)object->type) {
         case OBJ_BOUND_METHOD: {
-            FREE(obj_bound_method_t, object);
+            FREE_OBJ(obj_bound_method_t, object);
             break;
         }
         case OBJ_FUNCTION: {
             obj_function_t *function = (obj_function_t*)object;
             free_chunk(&function->chunk);
-            FREE(obj_function_t, function);
+            if (function->lazy != NULL) free_lazy_source(function->lazy);
+            FREE_OBJ(obj_function_t, function);
             break;
         }
         case OBJ_CLOSURE: {
             obj_closure_t *closure = (obj_closure_t*)object;
             FREE_ARRAY(obj_upvalue_t*, closure->upvalues, closure->upvalue_count);
-            FREE(obj_closure_t, object);
+            FREE_OBJ(obj_closure_t, object);
             break;
         }
         case OBJ_NATIVE: {
             obj_native_t *native = (obj_native_t*)object;
-            FREE(obj_native_t, native);
+            FREE_OBJ(obj_native_t, native);
             break;
         }
         case OBJ_CLASS: {
             obj_class_t *klass = (obj_class_t*)object;
             free_table(&klass->methods);
-            FREE(obj_class_t, object);
+            FREE_OBJ(obj_class_t, object);
             break;
         }
         case OBJ_INSTANCE: {
             obj_instance_t *instance = (obj_instance_t*)object;
             free_table(&instance->fields);
-            FREE(obj_instance_t, object);
+            FREE_OBJ(obj_instance_t, object);
+            break;
+        }
+        case OBJ_ARRAY: {
+            obj_array_t *array = (obj_array_t*)object;
+            free_table(&array->elements);
+            FREE_OBJ(obj_array_t, object);
             break;
         }
         case OBJ_STRING: {
             obj_string_t *string = (obj_string_t*)object;
-            FREE(obj_string_t, string);
+            reallocate_object(string, sizeof(obj_string_t) + string->length + 1, 0);
             break;
         }
         case OBJ_UPVALUE:
-            FREE(obj_upvalue_t, object);
+            FREE_OBJ(obj_upvalue_t, object);
             break;
     }
 }
 
+static void push_gray(obj_t *object)
+{
+    if (vm.gray_capacity < vm.gray_count + 1) {
+        vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
+        vm.gray_stack = (obj_t**)realloc(vm.gray_stack, sizeof(obj_t*) * vm.gray_capacity);
+
+        if (vm.gray_stack == NULL) exit(1);
+    }
+    vm.gray_stack[vm.gray_count++] = object;
+}
+
+#ifdef GC_THREADS
+static void push_worker(mark_worker_t *self, obj_t *object)
+{
+    if (self->capacity < self->count + 1) {
+        self->capacity = GROW_CAPACITY(self->capacity);
+        self->stack = (obj_t**)realloc(self->stack, sizeof(obj_t*) * self->capacity);
+
+        if (self->stack == NULL) exit(1);
+    }
+    self->stack[self->count++] = object;
+}
+#endif
+
 void mark_object(obj_t *object)
 {
     if (object == NULL) return;
-    if (object->is_marked) return;
+
+#ifdef GC_THREADS
+    if (worker != NULL) {
+        if (heap_try_mark(object)) push_worker(worker, object);
+        return;
+    }
+#endif
+
+    if (heap_is_marked(object)) return;
 
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void*)object);
@@ -99,15 +286,35 @@ void mark_object(obj_t *object)
     printf("\n");
 #endif
 
-    object->is_marked = true;
+    heap_set_mark(object);
+    push_gray(object);
+}
 
-    if (vm.gray_capacity < vm.gray_count + 1) {
-        vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
-        vm.gray_stack = (obj_t**)realloc(vm.gray_stack, sizeof(obj_t*) * vm.gray_capacity);
+// Has to follow every store of a reference into an existing object.
+// In generational mode marks survive a collection, so a marked object is
+// old and minor collections never trace it. If it may now point at a
+// young object, it's remembered and rescanned by the next minor collection.
+// While an incremental cycle is marking, a marked object is gray or black,
+// and a black one has to be rescanned so it can't hide a white object.
+// The concurrent marker owns the mark bits, so while it runs every object
+// written to is remembered and the final pause sorts them out.
+// Roots (the stack, globals, open upvalues) are rescanned anyway.
+void write_barrier(obj_t *object)
+{
+    if (vm.gc_mode == GC_FULL) return;
+    if (vm.gc_mode != GC_GENERATIONAL && vm.gc_phase != GC_MARKING) return;
+    if (object->gc_bits & GC_REMEMBERED) return;
+    if (vm.gc_mode != GC_CONCURRENT && !heap_is_marked(object)) return;
 
-        if (vm.gray_stack == NULL) exit(1);
+    object->gc_bits |= GC_REMEMBERED;
+
+    if (vm.remembered_capacity < vm.remembered_count + 1) {
+        vm.remembered_capacity = GROW_CAPACITY(vm.remembered_capacity);
+        vm.remembered = (obj_t**)realloc(vm.remembered, sizeof(obj_t*) * vm.remembered_capacity);
+
+        if (vm.remembered == NULL) exit(1);
     }
-    vm.gray_stack[vm.gray_count++] = object;
+    vm.remembered[vm.remembered_count++] = object;
 }
 
 void mark_value(value_t value)
@@ -117,8 +324,10 @@ void mark_value(value_t value)
 
 static void mark_array(value_array_t *array)
 {
-    for (int i = 0; i < array->count; i++) {
-        mark_value(array->values[i]);
+    int count = LOAD_ACQUIRE(array->count);
+    value_t *values = LOAD_ACQUIRE(array->values);
+    for (int i = 0; i < count; i++) {
+        mark_value(values[i]);
     }
 }
 
@@ -130,7 +339,7 @@ static void blacken_object(obj_t *object)
     printf("\n");
 #endif
 
-    switch (object->type) {
+    switch ((obj_type_e)object->type) {
         case OBJ_BOUND_METHOD: {
             obj_bound_method_t *bound = (obj_bound_method_t*)object;
             mark_value(bound->receiver);
@@ -166,6 +375,9 @@ static void blacken_object(obj_t *object)
             mark_table(&instance->fields);
             break;
         }
+        case OBJ_ARRAY:
+            mark_table(&((obj_array_t*)object)->elements);
+            break;
         case OBJ_NATIVE:
         case OBJ_STRING:
             break;
@@ -188,6 +400,7 @@ static void mark_roots(void)
 
     mark_table(&vm.globals);
     mark_compiler_roots();
+    mark_image_roots();
     mark_object((obj_t*)vm.init_string);
 }
 
@@ -199,59 +412,658 @@ static void trace_references(void)
     }
 }
 
-static void sweep(void)
+#ifdef GC_THREADS
+// Moves the older half of the private stack to the shared one, those
+// objects tend to lead to the bigger parts of the graph
+static void share_work(mark_worker_t *self)
 {
-    obj_t *previous = NULL;
-    obj_t *object = vm.objects;
+    int half = self->count / 2;
 
-    while (object != NULL) {
-        if (object->is_marked) {
-            object->is_marked = false;
-            previous = object;
-            object = object->next;
-        } else {
-            obj_t *unreached = object;
-            object = object->next;
-            if (previous != NULL) {
-                previous->next = object;
-            } else {
-                vm.objects = object;
+    pthread_mutex_lock(&self->lock);
+    if (self->shared_capacity < self->shared_count + half) {
+        self->shared_capacity = self->shared_count + half;
+        self->shared = (obj_t**)realloc(self->shared, sizeof(obj_t*) * self->shared_capacity);
+
+        if (self->shared == NULL) exit(1);
+    }
+    memcpy(self->shared + self->shared_count, self->stack, sizeof(obj_t*) * half);
+    STORE_RELEASE(self->shared_count, self->shared_count + half);
+    pthread_mutex_unlock(&self->lock);
+
+    self->count -= half;
+    memmove(self->stack, self->stack + half, sizeof(obj_t*) * self->count);
+}
+
+// Takes all of the own shared stack or half of another marker's one
+static bool take_work(mark_worker_t *self, mark_worker_t *victim)
+{
+    if (LOAD_ACQUIRE(victim->shared_count) == 0) return false;
+
+    pthread_mutex_lock(&victim->lock);
+    int taken = victim == self ? victim->shared_count : (victim->shared_count + 1) / 2;
+    int first = victim->shared_count - taken;
+    for (int i = 0; i < taken; i++) {
+        push_worker(self, victim->shared[first + i]);
+    }
+    STORE_RELEASE(victim->shared_count, first);
+    pthread_mutex_unlock(&victim->lock);
+
+    return taken > 0;
+}
+
+static bool find_work(mark_worker_t *self)
+{
+    if (take_work(self, self)) return true;
+
+    int index = (int)(self - workers);
+    for (int i = 1; i < worker_count; i++) {
+        if (take_work(self, &workers[(index + i) % worker_count])) return true;
+    }
+    return false;
+}
+
+// A marker only goes idle with both of its stacks empty, and only their
+// owner ever adds to them, so once every marker is idle the mark is done
+static bool all_idle(void)
+{
+    __atomic_add_fetch(&idle_workers, 1, __ATOMIC_ACQ_REL);
+    for (;;) {
+        if (LOAD_ACQUIRE(idle_workers) == worker_count) return true;
+
+        for (int i = 0; i < worker_count; i++) {
+            if (LOAD_ACQUIRE(workers[i].shared_count) > 0) {
+                __atomic_sub_fetch(&idle_workers, 1, __ATOMIC_ACQ_REL);
+                return false;
             }
+        }
+        sched_yield();
+    }
+}
 
-            free_object(unreached);
+static void *run_mark_worker(void *self)
+{
+    worker = (mark_worker_t*)self;
+    for (;;) {
+        while (worker->count > 0) {
+            obj_t *object = worker->stack[--worker->count];
+            blacken_object(object);
+
+            if (worker->count > GC_SHARE_THRESHOLD && LOAD_ACQUIRE(worker->shared_count) == 0) {
+                share_work(worker);
+            }
         }
+
+        if (!find_work(worker) && all_idle()) break;
     }
+    worker = NULL;
+    return NULL;
 }
 
-void collect_garbage(void)
+// Deals the gray roots out to vm.gc_threads markers, the calling thread
+// being one of them
+static void parallel_trace(void)
+{
+    worker_count = vm.gc_threads;
+    idle_workers = 0;
+    workers = (mark_worker_t*)calloc((size_t)worker_count, sizeof(mark_worker_t));
+    if (workers == NULL) exit(1);
+
+    for (int i = 0; i < worker_count; i++) {
+        pthread_mutex_init(&workers[i].lock, NULL);
+    }
+    for (int i = 0; i < vm.gray_count; i++) {
+        push_worker(&workers[i % worker_count], vm.gray_stack[i]);
+    }
+    vm.gray_count = 0;
+
+    for (int i = 1; i < worker_count; i++) {
+        spawn_thread(&workers[i].thread, run_mark_worker, &workers[i]);
+    }
+    run_mark_worker(&workers[0]);
+    for (int i = 1; i < worker_count; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < worker_count; i++) {
+        pthread_mutex_destroy(&workers[i].lock);
+        free(workers[i].stack);
+        free(workers[i].shared);
+    }
+    free(workers);
+    workers = NULL;
+}
+#endif
+
+// Stop-the-world tracing, shared by vm.gc_threads threads on big heaps
+static void trace_heap(void)
+{
+#ifdef GC_THREADS
+    if (vm.gc_threads > 1 && vm.bytes_allocated >= GC_PARALLEL_MIN) {
+        parallel_trace();
+        return;
+    }
+#endif
+    trace_references();
+}
+
+// Minor collections and incremental steps trace the remembered objects,
+// a major collection starts from cleared marks and forgets them. Unmarked
+// ones are either unreachable or get traced through whatever reaches them.
+static void mark_remembered(bool is_major)
+{
+    for (int i = 0; i < vm.remembered_count; i++) {
+        obj_t *object = vm.remembered[i];
+        object->gc_bits &= ~GC_REMEMBERED;
+        if (!is_major && heap_is_marked(object)) push_gray(object);
+    }
+    vm.remembered_count = 0;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+}
+
+// Telemetry: when the phase being timed started, if anyone is timing
+static uint64_t lap_start(void)
+{
+    return vm.gc_trace ? now_ns() : 0;
+}
+
+// Telemetry: charges the time since the last lap to a phase
+static uint64_t lap(gc_trace_phase_e phase, uint64_t since)
+{
+    if (!vm.gc_trace) return since;
+    uint64_t now = now_ns();
+    gc_trace_phase(phase, now - since);
+    return now;
+}
+
+static void end_trace(void)
+{
+    if (vm.gc_trace) gc_trace_end(now_ns(), vm.bytes_allocated);
+}
+
+// Takes the pacer's measurements of the period that ends here
+static void start_cycle(const char *kind)
+{
+    uint64_t now = now_ns();
+    cycles_started++;
+    if (vm.gc_trace) gc_trace_begin(kind, now, vm.bytes_allocated);
+    uint64_t spent = gc_ns - period_gc_ns;
+    if (period_start != 0 && now - period_start > spent) {
+        allocation_rate = (double)(allocated_total - period_allocated) /
+                          (double)(now - period_start - spent);
+        cycle_cost = spent;
+    }
+
+    period_start = now;
+    period_gc_ns = gc_ns;
+    period_allocated = allocated_total;
+}
+
+// Heap size at which the next cycle should start, given the live heap.
+// The grow factor sets the default, a target heap gives more room, so does
+// a time ratio when collecting takes too large a share of the time, and a
+// soft limit caps it all but always leaves some room.
+static size_t pace(size_t live)
+{
+    double goal = (double)live * GC_HEAP_GROW_FACTOR;
+    if ((double)vm.gc_target > goal) goal = (double)vm.gc_target;
+
+    if (vm.gc_time_ratio > 0 && cycle_cost > 0) {
+        // The program should run (1 - ratio) / ratio times as long as a cycle takes
+        double ratio = vm.gc_time_ratio;
+        double room = allocation_rate * (double)cycle_cost * (1 - ratio) / ratio;
+        if ((double)live + room > goal) goal = (double)live + room;
+    }
+
+    if (vm.gc_soft_limit > 0 && goal > (double)vm.gc_soft_limit) {
+        double least = (double)live + (double)(live / 16) + GC_MIN_ROOM;
+        goal = least > (double)vm.gc_soft_limit ? least : (double)vm.gc_soft_limit;
+    }
+    return (size_t)goal;
+}
+
+static void set_next_gc(void)
+{
+    if (vm.gc_mode == GC_GENERATIONAL) {
+        vm.next_gc = vm.bytes_allocated + GC_NURSERY_SIZE;
+        if (vm.gc_soft_limit > 0 && vm.next_gc > vm.gc_soft_limit) {
+            vm.next_gc = pace(vm.bytes_allocated);
+        }
+        if (cycle_is_major) {
+            vm.next_major = pace(vm.bytes_allocated) + GC_NURSERY_SIZE;
+        }
+    } else {
+        vm.next_gc = pace(vm.bytes_allocated);
+    }
+}
+
+// Sets one of the pacer settings: "target" and "limit" take a heap size in
+// bytes, "ratio" the share of time collection should take at most. Zero
+// turns a setting off.
+bool set_gc_pacer(const char *name, double value)
+{
+    if (strcmp(name, "target") == 0 && value >= 0) {
+        vm.gc_target = (size_t)value;
+    } else if (strcmp(name, "limit") == 0 && value >= 0) {
+        vm.gc_soft_limit = (size_t)value;
+    } else if (strcmp(name, "ratio") == 0 && value >= 0 && value < 1) {
+        vm.gc_time_ratio = value;
+    } else {
+        return false;
+    }
+
+    // The trigger that is already set follows right away
+    if (vm.gc_phase == GC_IDLE) {
+        size_t *trigger = vm.gc_mode == GC_GENERATIONAL ? &vm.next_major : &vm.next_gc;
+        if (*trigger < vm.gc_target) *trigger = vm.gc_target;
+        if (vm.gc_soft_limit > 0 && *trigger > vm.gc_soft_limit) {
+            *trigger = vm.gc_soft_limit > vm.bytes_allocated
+                ? vm.gc_soft_limit : vm.bytes_allocated + GC_MIN_ROOM;
+        }
+    }
+    return true;
+}
+
+// Hands the sweep over to the allocations that follow. Until it's done
+// the thresholds are based on a heap that still holds the garbage.
+static void begin_lazy_sweep(bool keep_marks)
+{
+#ifdef DEBUG_LOG_GC
+    bytes_before_sweep = vm.bytes_allocated;
+#endif
+    heap_begin_sweep(free_object, keep_marks);
+    vm.gc_phase = GC_SWEEPING;
+    set_next_gc();
+}
+
+// With --gc-compact, a full collection that leaves more than half of the
+// small pages reclaimable asks for a compaction at the next safe point
+static void check_fragmentation(void)
+{
+    if (!vm.gc_compact || !cycle_is_major) return;
+
+    int page_count;
+    int reclaimable;
+    heap_fragmentation(&page_count, &reclaimable);
+    if (reclaimable >= GC_COMPACT_MIN_PAGES && reclaimable * 2 > page_count) {
+        vm.compact_requested = true;
+    }
+}
+
+static void sweep_lazily(int page_budget)
+{
+    uint64_t time = lap_start();
+    bool is_done = heap_sweep_step(page_budget);
+    lap(GC_TRACE_SWEEP, time);
+    if (!is_done) return;
+
+    vm.gc_phase = GC_IDLE;
+    set_next_gc();
+    check_fragmentation();
+    end_trace();
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc sweep done\n");
+    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+           bytes_before_sweep - vm.bytes_allocated, bytes_before_sweep,
+           vm.bytes_allocated, vm.next_gc);
+#endif
+}
+
+// Returns false if the deadline passed before the gray stack ran empty
+static bool trace_until(uint64_t deadline)
+{
+    int work = 0;
+    while (vm.gray_count > 0) {
+        obj_t *object = vm.gray_stack[--vm.gray_count];
+        blacken_object(object);
+
+        if (++work % GC_STEP_CHECK == 0 && now_ns() >= deadline) return false;
+    }
+    return true;
+}
+
+// One bounded slice of an incremental cycle. Objects allocated while
+// marking start out white and survive only if the final remark or the
+// write barrier finds them, cells allocated while sweeping come from
+// pages that were swept first.
+static void incremental_step(void)
+{
+    uint64_t deadline = now_ns() + vm.gc_step_budget;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc step (phase %d)\n", vm.gc_phase);
+#endif
+
+    uint64_t time = lap_start();
+    if (vm.gc_phase == GC_IDLE) {
+        start_cycle("incremental");
+        mark_roots();
+        lap(GC_TRACE_ROOTS, time);
+        vm.gc_phase = GC_MARKING;
+    } else if (vm.gc_phase == GC_MARKING) {
+        mark_remembered(false);
+        bool is_done = trace_until(deadline);
+        time = lap(GC_TRACE_MARK, time);
+        if (is_done) {
+            // The roots aren't behind the barrier, so the last bit of marking
+            // rescans them without yielding to the program
+            mark_roots();
+            time = lap(GC_TRACE_ROOTS, time);
+            trace_references();
+            time = lap(GC_TRACE_MARK, time);
+            table_remove_white(&vm.strings);
+            lap(GC_TRACE_STRINGS, time);
+            heap_begin_sweep(free_object, false);
+            vm.gc_phase = GC_SWEEPING;
+            cycle_is_major = true;
+        }
+    } else {
+        bool is_done;
+        do {
+            is_done = heap_sweep_step(GC_STEP_PAGES);
+        } while (!is_done && now_ns() < deadline);
+        lap(GC_TRACE_SWEEP, time);
+
+        if (is_done) {
+            vm.gc_phase = GC_IDLE;
+            set_next_gc();
+            check_fragmentation();
+            end_trace();
+            return;
+        }
+    }
+
+    vm.next_gc = vm.bytes_allocated + GC_STEP_SIZE;
+}
+
+#ifdef GC_THREADS
+static void *run_marker(void *unused)
 {
+    (void)unused;
+    uint64_t time = lap_start();
+    trace_references();
+    lap(GC_TRACE_MARK, time);
+    STORE_RELEASE(marker_is_done, true);
+    return NULL;
+}
+
+static void start_marker(void)
+{
+    marker_is_done = false;
+    spawn_thread(&marker, run_marker, NULL);
+}
+
+static void join_marker(void)
+{
+    pthread_join(marker, NULL);
+    vm.gc_phase = GC_SWEEPING;
+    free_deferred();
+}
+
+// Objects allocated while the marker runs start out white, like in
+// incremental mode. Only the two pauses that bracket the cycle stop the
+// program: one grays the roots, the other rescans them and everything the
+// program wrote to, then sweeps.
+static void concurrent_step(void)
+{
+    if (vm.gc_phase == GC_IDLE) {
 #ifdef DEBUG_LOG_GC
-    printf("-- gc begin\n");
-    size_t before = vm.bytes_allocated;
+        printf("-- gc start marker\n");
 #endif
+        uint64_t time = lap_start();
+        start_cycle("concurrent");
+        mark_roots();
+        lap(GC_TRACE_ROOTS, time);
+        vm.gc_phase = GC_MARKING;
+        marking_limit = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+        vm.next_gc = vm.bytes_allocated + GC_STEP_SIZE;
+        start_marker();
+        return;
+    }
+
+    if (!LOAD_ACQUIRE(marker_is_done) && vm.bytes_allocated < marking_limit) {
+        vm.next_gc = vm.bytes_allocated + GC_STEP_SIZE;
+        return;
+    }
 
+#ifdef DEBUG_LOG_GC
+    printf("-- gc final pause\n");
+#endif
+    join_marker();
+    uint64_t time = lap_start();
+    mark_remembered(false);
     mark_roots();
-    trace_references(); // After this all objects are either black or white (only using is_marked)
+    time = lap(GC_TRACE_ROOTS, time);
+    trace_references();
+    time = lap(GC_TRACE_MARK, time);
     table_remove_white(&vm.strings);
-    sweep();
+    lap(GC_TRACE_STRINGS, time);
+    cycle_is_major = true;
+    begin_lazy_sweep(false);
+}
+#endif
 
-    vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+static void collect(void)
+{
+    if (vm.gc_mode == GC_INCREMENTAL) {
+        incremental_step();
+        return;
+    }
+
+    // Marking needs a fully swept heap
+    if (vm.gc_phase == GC_SWEEPING) sweep_lazily(INT_MAX);
+
+#ifdef GC_THREADS
+    if (vm.gc_mode == GC_CONCURRENT) {
+        concurrent_step();
+        return;
+    }
+#endif
+
+    bool is_generational = vm.gc_mode == GC_GENERATIONAL;
+    bool is_major = !is_generational || vm.bytes_allocated > vm.next_major;
 
 #ifdef DEBUG_LOG_GC
-    printf("-- gc end\n");
-    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-           before - vm.bytes_allocated, before, vm.bytes_allocated, vm.next_gc);
+    printf("-- gc begin (%s)\n", is_major ? "major" : "minor");
+#endif
+
+    uint64_t time = lap_start();
+    start_cycle(!is_generational ? "full" : is_major ? "major" : "minor");
+    if (is_generational) {
+        if (is_major) heap_clear_marks();
+        mark_remembered(is_major);
+    }
+
+    mark_roots();
+    time = lap(GC_TRACE_ROOTS, time);
+    trace_heap(); // After this all objects are either black or white (only using the mark bitmaps)
+    time = lap(GC_TRACE_MARK, time);
+    table_remove_white(&vm.strings);
+    lap(GC_TRACE_STRINGS, time);
+    // In generational mode survivors keep their marks, which promotes them
+    cycle_is_major = is_major;
+    begin_lazy_sweep(is_generational);
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end, sweeping lazily\n");
 #endif
 }
 
-void free_objects(void)
+void collect_garbage(void)
+{
+    uint64_t start = now_ns();
+    collect();
+    uint64_t pause = now_ns() - start;
+    gc_ns += pause;
+    gc_trace_pause(pause);
+}
+
+static void forward_value(value_t *value)
+{
+    if (IS_OBJ(*value)) *value = OBJ_VAL(heap_forward(AS_OBJ(*value)));
+}
+
+#define FORWARD(pointer) ((pointer) = (void*)heap_forward((obj_t*)(pointer)))
+
+static void forward_fields(obj_t *object)
+{
+    switch ((obj_type_e)object->type) {
+        case OBJ_BOUND_METHOD: {
+            obj_bound_method_t *bound = (obj_bound_method_t*)object;
+            forward_value(&bound->receiver);
+            FORWARD(bound->method);
+            break;
+        }
+        case OBJ_CLOSURE: {
+            obj_closure_t *closure = (obj_closure_t*)object;
+            FORWARD(closure->function);
+            for (int i = 0; i < closure->upvalue_count; i++) {
+                FORWARD(closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_FUNCTION: {
+            obj_function_t *function = (obj_function_t*)object;
+            FORWARD(function->name);
+            for (int i = 0; i < function->chunk.constants.count; i++) {
+                forward_value(&function->chunk.constants.values[i]);
+            }
+            break;
+        }
+        case OBJ_UPVALUE: {
+            obj_upvalue_t *upvalue = (obj_upvalue_t*)object;
+            forward_value(&upvalue->closed);
+            // Only open upvalues are linked, a closed one points at its
+            // own field, which moved along
+            if (upvalue->location >= vm.stack && upvalue->location < vm.stack + STACK_MAX) {
+                FORWARD(upvalue->next);
+            } else {
+                upvalue->location = &upvalue->closed;
+            }
+            break;
+        }
+        case OBJ_CLASS: {
+            obj_class_t *klass = (obj_class_t*)object;
+            FORWARD(klass->name);
+            FORWARD(klass->initializer);
+            table_forward(&klass->methods);
+            break;
+        }
+        case OBJ_INSTANCE: {
+            obj_instance_t *instance = (obj_instance_t*)object;
+            FORWARD(instance->klass);
+            table_forward(&instance->fields);
+            break;
+        }
+        case OBJ_ARRAY:
+            table_forward(&((obj_array_t*)object)->elements);
+            break;
+        case OBJ_NATIVE:
+        case OBJ_STRING:
+            break;
+    }
+}
+
+static void forward_roots(void)
 {
-    obj_t *object = vm.objects;
-    while (object != NULL) {
-        obj_t *next = object->next;
-        free_object(object);
-        object = next;
+    for (value_t *slot = vm.stack; slot < vm.stack_top; slot++) {
+        forward_value(slot);
+    }
+
+    for (int i = 0; i < vm.frame_count; i++) {
+        FORWARD(vm.frames[i].closure);
+    }
+
+    FORWARD(vm.open_upvalues);
+    table_forward(&vm.globals);
+    table_forward(&vm.strings);
+    FORWARD(vm.init_string);
+}
+
+// Runs a full collection, then moves the objects of sparse pages into
+// fuller ones and frees the emptied pages. Objects move, so this may only
+// run where no C code holds on to one: at the safe points of the
+// interpreter loop or from inside a native. Returns the number of objects
+// moved.
+int compact_heap(void)
+{
+    uint64_t start = now_ns();
+    vm.compact_requested = false;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc compact begin\n");
+#endif
+
+    // Whatever cycle is in progress is finished or dropped
+#ifdef GC_THREADS
+    if (marker_is_running()) join_marker();
+#endif
+    if (vm.gc_phase == GC_SWEEPING) {
+        while (!heap_sweep_step(INT_MAX));
+    }
+    vm.gray_count = 0;
+
+    start_cycle("compact");
+    uint64_t time = lap_start();
+    heap_clear_marks();
+    mark_remembered(true);
+    mark_roots();
+    time = lap(GC_TRACE_ROOTS, time);
+    trace_heap();
+    time = lap(GC_TRACE_MARK, time);
+    table_remove_white(&vm.strings);
+    time = lap(GC_TRACE_STRINGS, time);
+    heap_begin_sweep(free_object, false);
+    while (!heap_sweep_step(INT_MAX));
+    time = lap(GC_TRACE_SWEEP, time);
+
+    cpu_profile_hold(true);
+    int moved = heap_evacuate();
+    if (moved > 0) {
+        forward_roots();
+        heap_visit_objects(forward_fields);
+        heap_profile_forward();
     }
+    heap_release_evacuated();
+    cpu_profile_hold(false);
+    lap(GC_TRACE_COMPACT, time);
 
+    vm.gc_phase = GC_IDLE;
+    cycle_is_major = true;
+    set_next_gc();
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc compact end, moved %d objects\n", moved);
+#endif
+    uint64_t pause = now_ns() - start;
+    gc_ns += pause;
+    gc_trace_pause(pause);
+    end_trace();
+    return moved;
+}
+
+void gc_stats(gc_stats_t *stats)
+{
+    stats->bytes_allocated = allocated_total;
+    stats->cycles = cycles_started;
+    stats->pause_ns = gc_ns;
+}
+
+void free_objects(void)
+{
+#ifdef GC_THREADS
+    if (marker_is_running()) join_marker();
+#endif
+    free_deferred();
+    free(deferred);
+    free_heap(free_object);
+    free_heap_profile();
     free(vm.gray_stack);
+    free(vm.remembered);
 }
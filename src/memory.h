@@ -9,6 +9,8 @@
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
+#define FREE_OBJ(type, pointer) reallocate_object(pointer, sizeof(type), 0)
+
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity) * 2)
 
@@ -18,10 +20,35 @@
 #define FREE_ARRAY(type, pointer, old_count) \
     reallocate(pointer, sizeof(type) * (old_count), 0)
 
+typedef enum {
+    GC_FULL,         // Every collection marks and sweeps the whole heap
+    GC_GENERATIONAL, // Minor collections only trace objects allocated since the last one
+    GC_INCREMENTAL,  // Marking and sweeping are spread over small steps between allocations
+    GC_CONCURRENT,   // A background thread marks while the program runs
+} gc_mode_e;
+
+typedef enum {
+    GC_IDLE,
+    GC_MARKING,
+    GC_SWEEPING,
+} gc_phase_e;
+
+// Totals since the VM started, see gcStats() and benchmark()
+typedef struct {
+    size_t bytes_allocated; // Ever allocated
+    uint64_t cycles; // Collection cycles started
+    uint64_t pause_ns; // Time the program stood still for the collector
+} gc_stats_t;
+
 void *reallocate(void *pointer, size_t old_size, size_t new_size);
+void *reallocate_object(void *pointer, size_t old_size, size_t new_size);
 void free_objects(void);
 void collect_garbage(void);
+int compact_heap(void);
+bool set_gc_pacer(const char *name, double value);
 void mark_value(value_t value);
 void mark_object(obj_t *object);
+void write_barrier(obj_t *object);
+void gc_stats(gc_stats_t *stats);
 
 #endif
@@ -1,14 +1,150 @@
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
 
+#include "benchmark.h"
+#include "gc_trace.h"
+#include "heap_profile.h"
+#include "heap_snapshot.h"
+#include "memory.h"
 #include "object.h"
+#include "table.h"
+#include "vm.h"
 
 static inline value_t clock_native(int arg_count, value_t *args)
 {
     return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
+// nanoTime() reads the monotonic clock in nanoseconds, for measuring
+// elapsed time. A double holds it exactly for about a hundred days.
+static inline value_t nano_time_native(int arg_count, value_t *args)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return NUMBER_VAL((double)time.tv_sec * 1e9 + (double)time.tv_nsec);
+}
+
+// wallTime() is the time of day in seconds since the epoch
+static inline value_t wall_time_native(int arg_count, value_t *args)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_REALTIME, &time);
+    return NUMBER_VAL((double)time.tv_sec + (double)time.tv_nsec / 1e9);
+}
+
+// Sets array[name] = number, the name is kept alive while the table grows
+static inline void set_number_field(obj_array_t *array, const char *name, double number)
+{
+    push(OBJ_VAL(allocate_string(name, (int)strlen(name))));
+    table_set(&array->elements, vm.stack_top[-1], NUMBER_VAL(number));
+    write_barrier((obj_t*)array); // The key may be younger than the array
+    pop();
+}
+
+// gcStats() returns the collector totals so far: bytesAllocated,
+// collections and pauseNs
+static inline value_t gc_stats_native(int arg_count, value_t *args)
+{
+    gc_stats_t stats;
+    gc_stats(&stats);
+
+    obj_array_t *array = new_array();
+    push(OBJ_VAL(array));
+    set_number_field(array, "bytesAllocated", (double)stats.bytes_allocated);
+    set_number_field(array, "collections", (double)stats.cycles);
+    set_number_field(array, "pauseNs", (double)stats.pause_ns);
+    pop();
+    return OBJ_VAL(array);
+}
+
+// benchmark(function, seconds) times calls of a function without
+// arguments for about that long (a second by default), see benchmark.h.
+// It returns the nanoseconds per call (mean, median, stddev, min, max),
+// the samples and iterations measured, and what the collector did
+// meanwhile (bytesAllocated, collections, gcPauseNs). seconds must be a
+// positive finite number, and at most an hour is used.
+static inline value_t benchmark_native(int arg_count, value_t *args)
+{
+    if (arg_count < 1 || arg_count > 2 || (arg_count == 2 && !IS_NUMBER(args[1]))) {
+        return BOOL_VAL(false);
+    }
+
+    double seconds = arg_count == 2 ? AS_NUMBER(args[1]) : BENCHMARK_DEFAULT_SECONDS;
+    if (!isfinite(seconds) || seconds <= 0) return BOOL_VAL(false);
+    benchmark_result_t result;
+    if (!run_benchmark(&args[0], seconds, &result)) return NIL_VAL;
+
+    obj_array_t *array = new_array();
+    push(OBJ_VAL(array));
+    set_number_field(array, "mean", result.mean);
+    set_number_field(array, "median", result.median);
+    set_number_field(array, "stddev", result.stddev);
+    set_number_field(array, "min", result.min);
+    set_number_field(array, "max", result.max);
+    set_number_field(array, "samples", result.samples);
+    set_number_field(array, "iterations", (double)result.iterations);
+    set_number_field(array, "bytesAllocated", result.bytes_allocated);
+    set_number_field(array, "collections", result.collections);
+    set_number_field(array, "gcPauseNs", result.gc_pause_ns);
+    pop();
+    return OBJ_VAL(array);
+}
+
+// Compacts the heap right away, a native call is a safe point for it
+static inline value_t gc_compact_native(int arg_count, value_t *args)
+{
+    return NUMBER_VAL((double)compact_heap());
+}
+
+// gcTune(name, value) changes a pacer setting, see set_gc_pacer
+static inline value_t gc_tune_native(int arg_count, value_t *args)
+{
+    if (arg_count != 2 || !IS_STRING(args[0]) || !IS_NUMBER(args[1])) {
+        return BOOL_VAL(false);
+    }
+    return BOOL_VAL(set_gc_pacer(AS_CSTRING(args[0]), AS_NUMBER(args[1])));
+}
+
+// gcPauses() returns the pause histogram, element i counts the pauses
+// shorter than 2^i microseconds
+static inline value_t gc_pauses_native(int arg_count, value_t *args)
+{
+    uint64_t counts[GC_PAUSE_BUCKETS];
+    gc_pause_histogram(counts);
+
+    obj_array_t *array = new_array();
+    push(OBJ_VAL(array));
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        table_set(&array->elements, NUMBER_VAL(i), NUMBER_VAL((double)counts[i]));
+        write_barrier((obj_t*)array);
+    }
+    pop();
+    return OBJ_VAL(array);
+}
+
+// heapProfile(path) writes the heap profile so far, see heap_profile_write
+static inline value_t heap_profile_native(int arg_count, value_t *args)
+{
+    if (arg_count != 1 || !IS_STRING(args[0]) || vm.heap_profile_rate == 0) {
+        return BOOL_VAL(false);
+    }
+
+    FILE *file = fopen(AS_CSTRING(args[0]), "w");
+    if (file == NULL) return BOOL_VAL(false);
+    heap_profile_write(file);
+    fclose(file);
+    return BOOL_VAL(true);
+}
+
+// heapSnapshot(path) writes every live object, see heap_snapshot.h
+static inline value_t heap_snapshot_native(int arg_count, value_t *args)
+{
+    if (arg_count != 1 || !IS_STRING(args[0])) return BOOL_VAL(false);
+    return BOOL_VAL(write_heap_snapshot(AS_CSTRING(args[0])));
+}
+
 static inline value_t input_native(int arg_count, value_t *args)
 {
     char buffer[256];
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 
 #include "object.h"
+#include "heap_profile.h"
 #include "memory.h"
 #include "table.h"
 #include "value.h"
@@ -13,12 +14,11 @@
 
 static obj_t *allocate_object(size_t size, obj_type_e type)
 {
-    obj_t *object = (obj_t*)reallocate(NULL, 0, size);
-    object->type = type;
-    object->is_marked = false;
+    obj_t *object = (obj_t*)reallocate_object(NULL, 0, size);
+    object->type = (uint8_t)type;
+    object->gc_bits = 0;
 
-    object->next = vm.objects;
-    vm.objects = object;
+    if (vm.heap_profile_rate != 0) heap_profile_allocation(object, size);
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -37,13 +37,13 @@ static uint32_t hash_string(const char *key, int length)
     return hash;
 }
 
-static void print_function(obj_function_t *function)
+static void print_function(FILE *file, obj_function_t *function)
 {
     if (function->name == NULL) {
-        printf("<script>");
+        fprintf(file, "<script>");
         return;
     }
-    printf("<fn %s>", function->name->chars);
+    fprintf(file, "<fn %s>", function->name->chars);
 }
 
 obj_closure_t *new_closure(obj_function_t *function)
@@ -82,10 +82,31 @@ obj_function_t *new_function(void)
     function->arity = 0;
     function->upvalue_count = 0;
     function->name = NULL;
+    function->lazy = NULL;
     init_chunk(&function->chunk);
     return function;
 }
 
+// A copy, the source the function was skipped in may be gone by its
+// first call
+lazy_source_t *new_lazy_source(const char *start, int length, int line)
+{
+    lazy_source_t *lazy = (lazy_source_t*)reallocate(NULL, 0, sizeof(lazy_source_t) + length + 1);
+    lazy->line = line;
+    lazy->length = length;
+    lazy->type = 0;
+    lazy->in_class = false;
+    lazy->has_superclass = false;
+    memcpy(lazy->source, start, (size_t)length);
+    lazy->source[length] = '\0';
+    return lazy;
+}
+
+void free_lazy_source(lazy_source_t *lazy)
+{
+    reallocate(lazy, sizeof(lazy_source_t) + lazy->length + 1, 0);
+}
+
 obj_class_t *new_class(obj_string_t *name)
 {
     // klass because c++ compiler
@@ -142,15 +163,32 @@ obj_string_t *concatenate_strings(obj_string_t *a, obj_string_t *b)
 {
     int length = a->length + b->length;
 
-    char *temp_chars = malloc(length + 1);
-    memcpy(temp_chars, a->chars, a->length);
-    memcpy(temp_chars + a->length, b->chars, b->length);
-    temp_chars[length] = '\0';
+    // Built in place rather than in a scratch buffer, so a big result is
+    // copied once. The operands may not be on the stack, keep them alive.
+    push(OBJ_VAL(a));
+    push(OBJ_VAL(b));
+    obj_string_t *string = ALLOCATE_OBJ(obj_string_t, OBJ_STRING, length + 1);
+    pop();
+    pop();
+
+    string->length = length;
+    memcpy(string->chars, a->chars, a->length);
+    memcpy(string->chars + a->length, b->chars, b->length);
+    string->chars[length] = '\0';
+    string->hash = hash_string(string->chars, length);
+
+    obj_string_t *interned = table_find_string(&vm.strings, string->chars, length, string->hash);
+    if (interned != NULL) {
+        if (string->obj.gc_bits & GC_SAMPLED) heap_profile_free(&string->obj);
+        reallocate_object(string, sizeof(obj_string_t) + length + 1, 0);
+        return interned;
+    }
 
-    obj_string_t *result = allocate_string(temp_chars, length);
-    free(temp_chars);
+    push(OBJ_VAL(string));
+    table_set(&vm.strings, OBJ_VAL(string), NIL_VAL);
+    pop();
 
-    return result;
+    return string;
 }
 
 obj_string_t *number_to_string(double number) {
@@ -160,38 +198,59 @@ obj_string_t *number_to_string(double number) {
     return allocate_string(buffer, length);
 }
 
-void print_object(value_t value)
+const char *object_type_name(obj_type_e type)
+{
+    static const char *names[OBJ_TYPE_COUNT] = {
+        [OBJ_STRING] = "string",
+        [OBJ_ARRAY] = "array",
+        [OBJ_NATIVE] = "native",
+        [OBJ_FUNCTION] = "function",
+        [OBJ_CLOSURE] = "closure",
+        [OBJ_UPVALUE] = "upvalue",
+        [OBJ_CLASS] = "class",
+        [OBJ_INSTANCE] = "instance",
+        [OBJ_BOUND_METHOD] = "bound_method",
+    };
+    return names[type];
+}
+
+void fprint_object(FILE *file, value_t value)
 {
     switch (OBJ_TYPE(value)) {
         case OBJ_BOUND_METHOD: {
-            print_function(AS_BOUND_METHOD(value)->method->function);
+            print_function(file, AS_BOUND_METHOD(value)->method->function);
             break;
         }
         case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+            fprintf(file, "%s", AS_CSTRING(value));
             break;
         case OBJ_FUNCTION:
-            print_function(AS_FUNCTION(value));
+            print_function(file, AS_FUNCTION(value));
             break;
         case OBJ_CLOSURE:
-            print_function(AS_CLOSURE(value)->function);
+            print_function(file, AS_CLOSURE(value)->function);
             break;
         case OBJ_UPVALUE:
-            printf("upvalue");
+            fprintf(file, "upvalue");
             break;
         case OBJ_NATIVE:
-            printf("<native fn>");
+            fprintf(file, "<native fn>");
             break;
         case OBJ_CLASS:
-            printf("%s", AS_CLASS(value)->name->chars);
+            fprintf(file, "%s", AS_CLASS(value)->name->chars);
             break;
         case OBJ_INSTANCE:
-            printf("%s instance", AS_INSTANCE(value)->klass->name->chars);
+            fprintf(file, "%s instance", AS_INSTANCE(value)->klass->name->chars);
             break;
         case OBJ_ARRAY: {
             obj_array_t *array = AS_ARRAY(value);
-            table_print_all(&array->elements);
+            table_print_all(file, &array->elements);
             break;
         }
     }
 }
+
+void print_object(value_t value)
+{
+    fprint_object(stdout, value);
+}
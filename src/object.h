@@ -5,7 +5,7 @@
 #include "chunk.h"
 #include "table.h"
 
-#define OBJ_TYPE(value)   (AS_OBJ(value)->type)
+#define OBJ_TYPE(value)   ((obj_type_e)AS_OBJ(value)->type)
 
 #define IS_FUNCTION(value)     is_obj_type(value, OBJ_FUNCTION)
 #define IS_CLOSURE(value)      is_obj_type(value, OBJ_CLOSURE)
@@ -38,10 +38,18 @@ typedef enum {
     OBJ_BOUND_METHOD,
 } obj_type_e;
 
+#define OBJ_TYPE_COUNT (OBJ_BOUND_METHOD + 1)
+
+// Flags in obj_t::gc_bits
+#define GC_REMEMBERED 0x01 // Old object already in vm.remembered
+#define GC_SAMPLED 0x02 // Tracked by the heap profiler
+
+// The header is just the type tag and a few GC flags. Mark bits live in
+// the heap page bitmaps and the heap walks pages instead of an object list
+// (see heap.h), so the fields of every object start right after it.
 struct obj_t {
-    obj_type_e type;
-    bool is_marked;
-    struct obj_t *next;
+    uint8_t type; // obj_type_e
+    uint8_t gc_bits;
 };
 
 struct obj_string_t {
@@ -63,19 +71,31 @@ typedef struct {
     table_t elements;
 } obj_array_t;
 
+// The parameters and body of a function the compiler only pre-parsed,
+// compiled on its first call (see --lazy-compile)
+typedef struct {
+    int line;
+    int length;
+    uint8_t type; // The compiler's function_type_e
+    bool in_class;
+    bool has_superclass;
+    char source[];
+} lazy_source_t;
+
 typedef struct {
     obj_t obj;
     int arity;
     int upvalue_count;
     chunk_t chunk;
     obj_string_t *name;
+    lazy_source_t *lazy; // Not NULL while the chunk is still empty
 } obj_function_t;
 
 typedef struct {
     obj_t obj;
+    int upvalue_count;
     obj_function_t *function;
     obj_upvalue_t **upvalues;
-    int upvalue_count;
 } obj_closure_t;
 
 typedef struct {
@@ -110,6 +130,8 @@ static inline bool is_obj_type(value_t value, obj_type_e type)
 }
 
 obj_function_t *new_function(void);
+lazy_source_t *new_lazy_source(const char *start, int length, int line);
+void free_lazy_source(lazy_source_t *lazy);
 obj_closure_t *new_closure(obj_function_t *function);
 obj_upvalue_t *new_upvalue(value_t *slot);
 obj_native_t *new_native(native_fn function);
@@ -121,5 +143,7 @@ obj_string_t *allocate_string(const char *chars, int length);
 obj_string_t *concatenate_strings(obj_string_t *a, obj_string_t *b);
 obj_string_t *number_to_string(double number);
 void print_object(value_t value);
+void fprint_object(FILE *file, value_t value);
+const char *object_type_name(obj_type_e type);
 
 #endif
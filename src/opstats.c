@@ -0,0 +1,122 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define OPSTATS_TSC
+#endif
+
+#include "opstats.h"
+#include "chunk.h"
+#include "debug.h"
+#include "vm.h"
+
+#define OPSTATS_TOP_PAIRS 30
+
+static uint64_t op_counts[OP_CODE_COUNT];
+static uint64_t pair_counts[OP_CODE_COUNT][OP_CODE_COUNT];
+static uint64_t op_time[OP_CODE_COUNT];
+static int previous_op = -1;
+static uint64_t previous_time;
+
+static uint64_t read_clock(void)
+{
+#ifdef OPSTATS_TSC
+    return (uint64_t)__rdtsc();
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+#endif
+}
+
+void record_op(uint8_t instruction)
+{
+    op_counts[instruction]++;
+
+    if (previous_op >= 0) pair_counts[previous_op][instruction]++;
+
+    if (vm.op_timing) {
+        uint64_t now = read_clock();
+        if (previous_op >= 0) op_time[previous_op] += now - previous_time;
+        previous_time = now;
+    }
+    previous_op = instruction;
+}
+
+typedef struct {
+    int first;
+    int second; // -1 for a single opcode
+    uint64_t count;
+} op_row_t;
+
+static int compare_rows(const void *a, const void *b)
+{
+    uint64_t left = ((const op_row_t*)a)->count;
+    uint64_t right = ((const op_row_t*)b)->count;
+    return left < right ? 1 : left > right ? -1 : 0;
+}
+
+static double percent(uint64_t part, uint64_t total)
+{
+    return total > 0 ? 100.0 * (double)part / (double)total : 0;
+}
+
+void write_opstats(FILE *file)
+{
+    op_row_t ops[OP_CODE_COUNT];
+    uint64_t total = 0;
+    uint64_t total_time = 0;
+    int op_count = 0;
+    for (int op = 0; op < OP_CODE_COUNT; op++) {
+        total += op_counts[op];
+        total_time += op_time[op];
+        if (op_counts[op] == 0) continue;
+        ops[op_count].first = op;
+        ops[op_count].second = -1;
+        ops[op_count].count = op_counts[op];
+        op_count++;
+    }
+    qsort(ops, (size_t)op_count, sizeof(op_row_t), compare_rows);
+
+#ifdef OPSTATS_TSC
+    const char *unit = "cycles";
+#else
+    const char *unit = "ns";
+#endif
+
+    fprintf(file, "== opcodes (%llu executed) ==\n", (unsigned long long)total);
+    for (int i = 0; i < op_count; i++) {
+        int op = ops[i].first;
+        fprintf(file, "%-20s %14llu %6.2f%%", op_code_name((uint8_t)op),
+                (unsigned long long)ops[i].count, percent(ops[i].count, total));
+        if (vm.op_timing) {
+            fprintf(file, " %16llu %s %6.2f%% %8.1f/op", (unsigned long long)op_time[op], unit,
+                    percent(op_time[op], total_time), (double)op_time[op] / (double)ops[i].count);
+        }
+        fprintf(file, "\n");
+    }
+
+    static op_row_t pairs[OP_CODE_COUNT * OP_CODE_COUNT];
+    int pair_count = 0;
+    for (int first = 0; first < OP_CODE_COUNT; first++) {
+        for (int second = 0; second < OP_CODE_COUNT; second++) {
+            if (pair_counts[first][second] == 0) continue;
+            pairs[pair_count].first = first;
+            pairs[pair_count].second = second;
+            pairs[pair_count].count = pair_counts[first][second];
+            pair_count++;
+        }
+    }
+    qsort(pairs, (size_t)pair_count, sizeof(op_row_t), compare_rows);
+
+    fprintf(file, "== opcode pairs ==\n");
+    for (int i = 0; i < pair_count && i < OPSTATS_TOP_PAIRS; i++) {
+        fprintf(file, "%-20s %-20s %14llu %6.2f%%\n", op_code_name((uint8_t)pairs[i].first),
+                op_code_name((uint8_t)pairs[i].second), (unsigned long long)pairs[i].count,
+                percent(pairs[i].count, total > 0 ? total - 1 : 0));
+    }
+}
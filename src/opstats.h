@@ -0,0 +1,16 @@
+#ifndef CLOX_OPSTATS_H
+#define CLOX_OPSTATS_H
+
+#include <stdio.h>
+
+#include "common.h"
+
+// Opcode statistics for --opstats. run() hands every instruction to
+// record_op() while vm.op_stats is set, which counts it and the pair it
+// forms with the instruction before. With vm.op_timing the time up to the
+// next instruction is charged to it as well, in TSC cycles where there is
+// a time stamp counter and in nanoseconds elsewhere.
+void record_op(uint8_t instruction);
+void write_opstats(FILE *file);
+
+#endif
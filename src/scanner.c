@@ -3,19 +3,29 @@
 #include "scanner.h"
 #include "common.h"
 
-typedef struct {
-    const char *start;
-    const char *current;
-    int line;
-} scanner_t;
-
 scanner_t scanner;
 
 void init_scanner(const char *source)
+{
+    init_scanner_at(source, 1);
+}
+
+// For source cut out of a bigger file, so lines keep their numbers
+void init_scanner_at(const char *source, int line)
 {
     scanner.start = source;
     scanner.current = source;
-    scanner.line = 1;
+    scanner.line = line;
+}
+
+scanner_t save_scanner(void)
+{
+    return scanner;
+}
+
+void restore_scanner(scanner_t state)
+{
+    scanner = state;
 }
 
 static bool is_digit(char c)
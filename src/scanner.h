@@ -39,7 +39,16 @@ typedef struct {
     int line;
 } token_t;
 
+typedef struct {
+    const char *start;
+    const char *current;
+    int line;
+} scanner_t;
+
 void init_scanner(const char *source);
+void init_scanner_at(const char *source, int line);
+scanner_t save_scanner(void);
+void restore_scanner(scanner_t state);
 token_t scan_token(void);
 
 #endif
@@ -0,0 +1,193 @@
+#if defined(__unix__) || defined(__APPLE__)
+#define _POSIX_C_SOURCE 200112L
+#define SERIAL_MMAP
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef SERIAL_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "serial.h"
+#include "memory.h"
+
+bool map_file(const char *path, mapped_file_t *file)
+{
+#ifdef SERIAL_MMAP
+    int descriptor = open(path, O_RDONLY);
+    if (descriptor < 0) return false;
+
+    struct stat status;
+    if (fstat(descriptor, &status) != 0 || status.st_size <= 0) {
+        close(descriptor);
+        return false;
+    }
+
+    size_t size = (size_t)status.st_size;
+    void *bytes = mmap(NULL, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    close(descriptor);
+    if (bytes == MAP_FAILED) return false;
+
+    file->bytes = (const uint8_t*)bytes;
+    file->size = size;
+    file->is_mapped = true;
+    return true;
+#else
+    FILE *stream = fopen(path, "rb");
+    if (stream == NULL) return false;
+
+    fseek(stream, 0L, SEEK_END);
+    long size = ftell(stream);
+    rewind(stream);
+    uint8_t *bytes = size > 0 ? (uint8_t*)malloc((size_t)size) : NULL;
+    bool is_read = bytes != NULL && fread(bytes, 1, (size_t)size, stream) == (size_t)size;
+    fclose(stream);
+    if (!is_read) {
+        free(bytes);
+        return false;
+    }
+
+    file->bytes = bytes;
+    file->size = (size_t)size;
+    file->is_mapped = false;
+    return true;
+#endif
+}
+
+void unmap_file(mapped_file_t *file)
+{
+#ifdef SERIAL_MMAP
+    if (file->is_mapped) munmap((void*)file->bytes, file->size);
+#endif
+    if (!file->is_mapped) free((void*)file->bytes);
+    file->bytes = NULL;
+    file->size = 0;
+}
+
+const uint8_t *read_bytes(reader_t *reader, size_t count)
+{
+    if (reader->failed || (size_t)(reader->end - reader->at) < count) {
+        reader->failed = true;
+        return NULL;
+    }
+    const uint8_t *bytes = reader->at;
+    reader->at += count;
+    return bytes;
+}
+
+uint8_t read_u8(reader_t *reader)
+{
+    const uint8_t *byte = read_bytes(reader, 1);
+    return byte != NULL ? *byte : 0;
+}
+
+uint32_t read_u32(reader_t *reader)
+{
+    uint32_t value = 0;
+    const uint8_t *bytes = read_bytes(reader, sizeof(value));
+    if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+double read_double(reader_t *reader)
+{
+    double value = 0;
+    const uint8_t *bytes = read_bytes(reader, sizeof(value));
+    if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+// Interned like every other string
+obj_string_t *read_string(reader_t *reader, uint32_t length)
+{
+    const uint8_t *chars = read_bytes(reader, length);
+    if (chars == NULL || length > INT32_MAX) return NULL;
+    return allocate_string((const char*)chars, (int)length);
+}
+
+// The code, then the lines as runs of (line, instruction count) since most
+// lines span several instructions. The chunk has to be empty.
+bool read_code(reader_t *reader, chunk_t *chunk)
+{
+    uint32_t count = read_u32(reader);
+    const uint8_t *code = read_bytes(reader, count);
+    if (code == NULL || count == 0 || count > INT32_MAX) return false;
+
+    chunk->code = GROW_ARRAY(uint8_t, NULL, 0, count);
+    chunk->lines = GROW_ARRAY(int, NULL, 0, count);
+    chunk->capacity = (int)count;
+    chunk->count = (int)count;
+    memcpy(chunk->code, code, count);
+
+    uint32_t runs = read_u32(reader);
+    int offset = 0;
+    for (uint32_t i = 0; i < runs && !reader->failed; i++) {
+        uint32_t line = read_u32(reader);
+        uint32_t length = read_u32(reader);
+        if (length > (uint32_t)(chunk->count - offset)) return false;
+        for (uint32_t j = 0; j < length; j++) chunk->lines[offset++] = (int)line;
+    }
+    return !reader->failed && offset == chunk->count;
+}
+
+void write_u32(FILE *file, uint32_t value)
+{
+    fwrite(&value, sizeof(value), 1, file);
+}
+
+void write_double(FILE *file, double value)
+{
+    fwrite(&value, sizeof(value), 1, file);
+}
+
+void write_counted(FILE *file, const void *bytes, uint32_t count)
+{
+    write_u32(file, count);
+    fwrite(bytes, 1, count, file);
+}
+
+void write_code(FILE *file, chunk_t *chunk)
+{
+    write_counted(file, chunk->code, (uint32_t)chunk->count);
+
+    uint32_t runs = 0;
+    for (int i = 0; i < chunk->count; i++) {
+        if (i == 0 || chunk->lines[i] != chunk->lines[i - 1]) runs++;
+    }
+
+    write_u32(file, runs);
+    for (int i = 0; i < chunk->count;) {
+        int end = i;
+        while (end < chunk->count && chunk->lines[end] == chunk->lines[i]) end++;
+        write_u32(file, (uint32_t)chunk->lines[i]);
+        write_u32(file, (uint32_t)(end - i));
+        i = end;
+    }
+}
+
+bool write_file_atomically(const char *path, bool (*write)(FILE *file, void *data), void *data)
+{
+    size_t length = strlen(path);
+    char *temporary = (char*)malloc(length + 5);
+    if (temporary == NULL) return false;
+    memcpy(temporary, path, length);
+    strcpy(temporary + length, ".tmp");
+
+    FILE *file = fopen(temporary, "w+b");
+    if (file == NULL) {
+        free(temporary);
+        return false;
+    }
+
+    bool is_written = write(file, data) && !ferror(file);
+    if (fclose(file) != 0) is_written = false;
+    if (is_written) is_written = rename(temporary, path) == 0;
+    if (!is_written) remove(temporary);
+    free(temporary);
+    return is_written;
+}
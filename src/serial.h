@@ -0,0 +1,48 @@
+#ifndef CLOX_SERIAL_H
+#define CLOX_SERIAL_H
+
+#include <stdio.h>
+
+#include "chunk.h"
+#include "object.h"
+
+// Helpers for the binary files the VM writes and reads back, the bytecode
+// cache and the heap image. Integers are in the byte order of the machine
+// that wrote the file, each format says in its header which order it was.
+
+// A whole file, mapped where the system can map files and read into
+// memory elsewhere
+typedef struct {
+    const uint8_t *bytes;
+    size_t size;
+    bool is_mapped;
+} mapped_file_t;
+
+bool map_file(const char *path, mapped_file_t *file);
+void unmap_file(mapped_file_t *file);
+
+// Reads stop at the end of the bytes and set failed instead
+typedef struct {
+    const uint8_t *at;
+    const uint8_t *end;
+    bool failed;
+} reader_t;
+
+const uint8_t *read_bytes(reader_t *reader, size_t count);
+uint8_t read_u8(reader_t *reader);
+uint32_t read_u32(reader_t *reader);
+double read_double(reader_t *reader);
+obj_string_t *read_string(reader_t *reader, uint32_t length);
+bool read_code(reader_t *reader, chunk_t *chunk);
+
+void write_u32(FILE *file, uint32_t value);
+void write_double(FILE *file, double value);
+void write_counted(FILE *file, const void *bytes, uint32_t count);
+void write_code(FILE *file, chunk_t *chunk);
+
+// Writes to a temporary file renamed over the path when write() succeeds,
+// so nobody ever reads a half written file. write() may also read back
+// what it wrote.
+bool write_file_atomically(const char *path, bool (*write)(FILE *file, void *data), void *data);
+
+#endif
@@ -1,9 +1,11 @@
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "table.h"
 #include "object.h"
 #include "memory.h"
+#include "heap.h"
 #include "value.h"
 
 #define TABLE_MAX_LOAD 0.75
@@ -99,8 +101,8 @@ static void adjust_capacity(table_t *table, int capacity)
     }
 
     FREE_ARRAY(entry_t, table->entries, table->capacity);
-    table->entries = entries;
-    table->capacity = capacity;
+    STORE_RELEASE(table->entries, entries);
+    STORE_RELEASE(table->capacity, capacity);
 }
 
 bool table_set(table_t *table, value_t key, value_t value)
@@ -174,10 +176,31 @@ obj_string_t *table_find_string(table_t *table, const char *chars, int length, u
     }
 }
 
-void mark_table(table_t *table)
+// How many slots a lookup of each key looks at, for the microbenchmarks
+void table_probe_stats(table_t *table, double *average, int *longest)
 {
+    long total = 0;
+    int keys = 0;
+    *longest = 0;
     for (int i = 0; i < table->capacity; i++) {
-        entry_t *entry = &table->entries[i];
+        value_t key = table->entries[i].key;
+        if (IS_NIL(key)) continue;
+
+        uint32_t home = hash_value(key) & (table->capacity - 1);
+        int probes = (int)(((uint32_t)i - home) & (table->capacity - 1)) + 1;
+        total += probes;
+        keys++;
+        if (probes > *longest) *longest = probes;
+    }
+    *average = keys > 0 ? (double)total / keys : 0;
+}
+
+void mark_table(table_t *table)
+{
+    int capacity = LOAD_ACQUIRE(table->capacity);
+    entry_t *entries = LOAD_ACQUIRE(table->entries);
+    for (int i = 0; i < capacity; i++) {
+        entry_t *entry = &entries[i];
         mark_value(entry->key);
         mark_value(entry->value);
     }
@@ -188,25 +211,77 @@ void table_remove_white(table_t *table)
     for (int i = 0; i < table->capacity; i++) {
         entry_t *entry = &table->entries[i];
         if (!IS_NIL(entry->key) && IS_OBJ(entry->key) &&
-            !AS_OBJ(entry->key)->is_marked) {
+            !heap_is_marked(AS_OBJ(entry->key))) {
             table_delete(table, entry->key);
         }
     }
 }
 
-void table_print_all(table_t *table)
+static value_t forward_value(value_t value)
+{
+    return IS_OBJ(value) ? OBJ_VAL(heap_forward(AS_OBJ(value))) : value;
+}
+
+// Reinserts every entry into the same buffer, without allocating through
+// the GC so it's safe in the middle of a compaction
+static void rehash(table_t *table)
+{
+    size_t size = sizeof(entry_t) * table->capacity;
+    entry_t *old = (entry_t*)malloc(size);
+    if (old == NULL) exit(1);
+    memcpy(old, table->entries, size);
+
+    for (int i = 0; i < table->capacity; i++) {
+        table->entries[i].key = NIL_VAL;
+        table->entries[i].value = NIL_VAL;
+    }
+
+    table->count = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        if (IS_NIL(old[i].key)) continue;
+
+        entry_t *dest = find_entry(table->entries, table->capacity, old[i].key);
+        dest->key = old[i].key;
+        dest->value = old[i].value;
+        table->count++;
+    }
+
+    free(old);
+}
+
+// Updates keys and values after a compaction. Strings hash their
+// characters, but other objects hash their address, so a table with such
+// a key that moved is rehashed.
+void table_forward(table_t *table)
+{
+    bool needs_rehash = false;
+    for (int i = 0; i < table->capacity; i++) {
+        entry_t *entry = &table->entries[i];
+        if (IS_OBJ(entry->key)) {
+            obj_t *object = AS_OBJ(entry->key);
+            obj_t *moved = heap_forward(object);
+            if (moved != object && moved->type != OBJ_STRING) needs_rehash = true;
+            entry->key = OBJ_VAL(moved);
+        }
+        entry->value = forward_value(entry->value);
+    }
+
+    if (needs_rehash) rehash(table);
+}
+
+void table_print_all(FILE *file, table_t *table)
 {
-    printf("{");
+    fprintf(file, "{");
     bool first = true;
     for (int i =0; i < table->capacity; i++) {
         entry_t *entry = &table->entries[i];
         if (!IS_NIL(entry->key) && !IS_NIL(entry->value)) {
-            if (!first) printf(", ");
-            print_value(entry->key);
-            printf(": ");
-            print_value(entry->value);
+            if (!first) fprintf(file, ", ");
+            fprint_value(file, entry->key);
+            fprintf(file, ": ");
+            fprint_value(file, entry->value);
             first = false;
         }
     }
-    printf("}");
+    fprintf(file, "}");
 }
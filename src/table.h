@@ -28,6 +28,8 @@ void table_add_all(table_t *from, table_t *to);
 obj_string_t *table_find_string(table_t *table, const char *chars, int length, uint32_t hash);
 void mark_table(table_t *table);
 void table_remove_white(table_t *table);
-void table_print_all(table_t *table);
+void table_forward(table_t *table);
+void table_print_all(FILE *file, table_t *table);
+void table_probe_stats(table_t *table, double *average, int *longest);
 
 #endif
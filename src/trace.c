@@ -0,0 +1,153 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+#include "debug.h"
+#include "vm.h"
+
+#define TRACE_VERSION 1
+
+typedef struct {
+    uint64_t top; // The value on top of the stack, NaN-boxed
+    uint32_t function; // Index into the function table
+    uint32_t offset;
+    uint32_t line;
+    uint16_t stack_depth;
+    uint8_t op;
+    uint8_t frame_depth;
+} trace_record_t;
+
+typedef struct {
+    char *name;
+    int line;
+} trace_function_t;
+
+static trace_record_t *records = NULL;
+static size_t record_capacity = 0;
+static size_t next_record = 0;
+static uint64_t executed = 0;
+
+static trace_function_t *functions = NULL;
+static int function_count = 0;
+static int function_capacity = 0;
+
+bool start_trace(size_t buffer_size)
+{
+    record_capacity = buffer_size / sizeof(trace_record_t);
+    if (record_capacity == 0) record_capacity = 1;
+    records = (trace_record_t*)malloc(record_capacity * sizeof(trace_record_t));
+    return records != NULL;
+}
+
+// Values are stored the way NAN_BOXING lays them out in either build, so
+// the decoder only knows one format
+static uint64_t encode_value(value_t value)
+{
+    const uint64_t qnan = 0x7ffc000000000000;
+    if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        return bits;
+    }
+    if (IS_NIL(value)) return qnan | 1;
+    if (IS_BOOL(value)) return qnan | (AS_BOOL(value) ? 3 : 2);
+    return 0x8000000000000000 | qnan | (uint64_t)(uintptr_t)AS_OBJ(value);
+}
+
+// Functions are numbered the first time they run. The number is kept in
+// the chunk, which moves along with the function when the heap compacts.
+static uint32_t function_index(obj_function_t *function)
+{
+    chunk_t *chunk = &function->chunk;
+    if (chunk->trace_id != 0) return (uint32_t)(chunk->trace_id - 1);
+
+    if (function_capacity < function_count + 1) {
+        function_capacity = function_capacity < 64 ? 64 : function_capacity * 2;
+        functions = (trace_function_t*)realloc(functions, sizeof(trace_function_t) * function_capacity);
+        if (functions == NULL) exit(1);
+    }
+
+    const char *name = function->name != NULL ? function->name->chars : "<script>";
+    size_t length = strlen(name);
+    trace_function_t *entry = &functions[function_count];
+    entry->name = (char*)malloc(length + 1);
+    if (entry->name == NULL) exit(1);
+    memcpy(entry->name, name, length + 1);
+    entry->line = chunk->count > 0 ? chunk->lines[0] : 0;
+
+    chunk->trace_id = ++function_count;
+    return (uint32_t)(function_count - 1);
+}
+
+void trace_instruction(obj_function_t *function, int offset, int frame_depth)
+{
+    trace_record_t *record = &records[next_record];
+    int stack_depth = (int)(vm.stack_top - vm.stack);
+
+    record->top = stack_depth > 0 ? encode_value(vm.stack_top[-1]) : encode_value(NIL_VAL);
+    record->function = function_index(function);
+    record->offset = (uint32_t)offset;
+    record->line = (uint32_t)function->chunk.lines[offset];
+    record->stack_depth = (uint16_t)stack_depth;
+    record->op = function->chunk.code[offset];
+    record->frame_depth = (uint8_t)(frame_depth > UINT8_MAX ? UINT8_MAX : frame_depth);
+
+    if (++next_record == record_capacity) next_record = 0;
+    executed++;
+}
+
+static void write_u32(FILE *file, uint32_t value)
+{
+    fwrite(&value, sizeof(value), 1, file);
+}
+
+static void write_name(FILE *file, const char *name)
+{
+    uint32_t length = (uint32_t)strlen(name);
+    write_u32(file, length);
+    fwrite(name, 1, length, file);
+}
+
+bool write_trace(FILE *file)
+{
+    fwrite("LOXTRACE", 1, 8, file);
+    write_u32(file, TRACE_VERSION);
+    write_u32(file, (uint32_t)sizeof(trace_record_t));
+
+    write_u32(file, OP_CODE_COUNT);
+    for (int op = 0; op < OP_CODE_COUNT; op++) {
+        write_name(file, op_code_name((uint8_t)op));
+    }
+
+    write_u32(file, (uint32_t)function_count);
+    for (int i = 0; i < function_count; i++) {
+        write_u32(file, (uint32_t)functions[i].line);
+        write_name(file, functions[i].name);
+    }
+
+    fwrite(&executed, sizeof(executed), 1, file);
+    if (executed < record_capacity) {
+        write_u32(file, (uint32_t)executed);
+        fwrite(records, sizeof(trace_record_t), (size_t)executed, file);
+    } else {
+        write_u32(file, (uint32_t)record_capacity);
+        fwrite(records + next_record, sizeof(trace_record_t), record_capacity - next_record, file);
+        fwrite(records, sizeof(trace_record_t), next_record, file);
+    }
+    return !ferror(file);
+}
+
+void free_trace(void)
+{
+    for (int i = 0; i < function_count; i++) free(functions[i].name);
+    free(functions);
+    free(records);
+    functions = NULL;
+    function_count = 0;
+    function_capacity = 0;
+    records = NULL;
+    record_capacity = 0;
+    next_record = 0;
+    executed = 0;
+}
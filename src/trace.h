@@ -0,0 +1,26 @@
+#ifndef CLOX_TRACE_H
+#define CLOX_TRACE_H
+
+#include <stdio.h>
+
+#include "object.h"
+
+#define TRACE_DEFAULT_BUFFER (4 * 1024 * 1024)
+
+// Execution trace for --trace. While vm.tracing is set run() records every
+// instruction it executes as a fixed size record in a ring buffer, so a
+// long run keeps its most recent instructions at a bounded cost. The
+// buffer is written in binary at exit and tools/trace_decode.py turns it
+// into a listing.
+//
+// The file starts with "LOXTRACE" and a version, followed by the opcode
+// names, the function table, the number of instructions executed and the
+// records left in the ring, oldest first. Integers are in the byte order
+// of the machine that wrote it, which the decoder works out from the
+// version.
+bool start_trace(size_t buffer_size);
+void trace_instruction(obj_function_t *function, int offset, int frame_depth);
+bool write_trace(FILE *file);
+void free_trace(void);
+
+#endif
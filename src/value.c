@@ -23,41 +23,47 @@ void write_value_array(value_array_t *array, value_t value)
     if (array->capacity < array->count + 1) {
         int old_capacity = array->capacity;
         array->capacity = GROW_CAPACITY(old_capacity);
-        array->values = GROW_ARRAY(value_t, array->values, old_capacity, array->capacity);
+        value_t *values = GROW_ARRAY(value_t, array->values, old_capacity, array->capacity);
+        STORE_RELEASE(array->values, values);
     }
 
     array->values[array->count] = value;
-    array->count++;
+    STORE_RELEASE(array->count, array->count + 1);
 }
 
-void print_value(value_t value)
+void fprint_value(FILE *file, value_t value)
 {
 #ifdef NAN_BOXING
     if (IS_BOOL(value)) {
-        printf(AS_BOOL(value) ? "true" : "false");
+        fprintf(file, AS_BOOL(value) ? "true" : "false");
     } else if (IS_NIL(value)) {
-        printf("nil");
+        fprintf(file, "nil");
     } else if (IS_NUMBER(value)) {
-        printf("%g", AS_NUMBER(value));
+        fprintf(file, "%g", AS_NUMBER(value));
     } else if (IS_OBJ(value)) {
-        print_object(value);
+        fprint_object(file, value);
     }
 #else
     switch (value.type) {
         case VAL_BOOL:
-            printf(AS_BOOL(value) ? "true" : "false");
+            fprintf(file, AS_BOOL(value) ? "true" : "false");
             break;
         case VAL_NIL:
-            printf("nil");
+            fprintf(file, "nil");
             break;
         case VAL_NUMBER:
-            printf("%g", AS_NUMBER(value));
+            fprintf(file, "%g", AS_NUMBER(value));
             break;
-        case VAL_OBJ: print_object(value); break;
+        case VAL_OBJ: fprint_object(file, value); break;
     }
 #endif
 }
 
+void print_value(value_t value)
+{
+    fprint_value(stdout, value);
+}
+
 bool values_equal(value_t a, value_t b)
 {
 #ifdef NAN_BOXING
@@ -1,6 +1,7 @@
 #ifndef CLOX_VALUE_H
 #define CLOX_VALUE_H
 
+#include <stdio.h>
 #include <string.h>
 
 #include "common.h"
@@ -99,6 +100,7 @@ void init_value_array(value_array_t *array);
 void write_value_array(value_array_t *array, value_t value);
 void free_value_array(value_array_t *array);
 void print_value(value_t value);
+void fprint_value(FILE *file, value_t value);
 bool values_equal(value_t a, value_t b);
 
 #endif
@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
@@ -5,7 +7,9 @@
 
 #include "vm.h"
 #include "chunk.h"
-#include "debug.h"
+#include "coverage.h"
+#include "trace.h"
+#include "opstats.h"
 #include "compiler.h"
 #include "table.h"
 #include "value.h"
@@ -19,6 +23,7 @@ static void reset_stack(void)
 {
     vm.stack_top = vm.stack;
     vm.frame_count = 0;
+    vm.base_frame = 0;
     vm.open_upvalues = NULL;
 }
 
@@ -46,8 +51,20 @@ static void runtime_error(const char *format, ...)
     reset_stack();
 } 
 
+#define NATIVES_MAX 32
+
+// Every native by name, so a heap image can refer to them
+static const char *native_names[NATIVES_MAX];
+static native_fn native_functions[NATIVES_MAX];
+static int native_count = 0;
+
 static void define_native(const char *name, native_fn function)
 {
+    if (native_count < NATIVES_MAX) {
+        native_names[native_count] = name;
+        native_functions[native_count++] = function;
+    }
+
     push(OBJ_VAL(allocate_string(name, (int)strlen(name))));
     push(OBJ_VAL(new_native(function)));
     table_set(&vm.globals, OBJ_VAL(AS_STRING(vm.stack[0])), vm.stack[1]);
@@ -55,10 +72,27 @@ static void define_native(const char *name, native_fn function)
     pop();
 }
 
+const char *native_name(native_fn function)
+{
+    for (int i = 0; i < native_count; i++) {
+        if (native_functions[i] == function) return native_names[i];
+    }
+    return NULL;
+}
+
+native_fn find_native(const char *name)
+{
+    for (int i = 0; i < native_count; i++) {
+        if (strcmp(native_names[i], name) == 0) return native_functions[i];
+    }
+    return NULL;
+}
+
 void init_vm(void)
 {
+    native_count = 0;
     reset_stack();
-    vm.objects = NULL;
+    vm.native_error = false;
     vm.bytes_allocated = 0;
     vm.next_gc = 1024 * 1024;
 
@@ -66,6 +100,28 @@ void init_vm(void)
     vm.gray_capacity = 0;
     vm.gray_stack = NULL;
 
+    vm.gc_mode = GC_FULL;
+    vm.next_major = vm.next_gc;
+    vm.remembered_count = 0;
+    vm.remembered_capacity = 0;
+    vm.remembered = NULL;
+    vm.gc_phase = GC_IDLE;
+    vm.gc_step_budget = 500 * 1000;
+    vm.gc_threads = 1;
+    vm.gc_compact = false;
+    vm.compact_requested = false;
+    vm.gc_target = 0;
+    vm.gc_soft_limit = 0;
+    vm.gc_time_ratio = 0;
+    vm.gc_trace = false;
+    vm.heap_profile_rate = 0;
+    vm.instrumented = false;
+    vm.op_stats = false;
+    vm.op_timing = false;
+    vm.coverage = false;
+    vm.lazy_compile = false;
+    vm.tracing = false;
+
     init_table(&vm.globals);
     init_table(&vm.strings);
 
@@ -73,7 +129,16 @@ void init_vm(void)
     vm.init_string = allocate_string("init", 4);
 
     define_native("clock", clock_native);
+    define_native("nanoTime", nano_time_native);
+    define_native("wallTime", wall_time_native);
+    define_native("gcStats", gc_stats_native);
+    define_native("benchmark", benchmark_native);
     define_native("input", input_native);
+    define_native("gcCompact", gc_compact_native);
+    define_native("gcTune", gc_tune_native);
+    define_native("gcPauses", gc_pauses_native);
+    define_native("heapProfile", heap_profile_native);
+    define_native("heapSnapshot", heap_snapshot_native);
 }
 
 void free_vm(void)
@@ -114,10 +179,17 @@ static bool call(obj_closure_t *closure, int arg_count)
         return false;
     }
 
-    call_frame_t *frame = &vm.frames[vm.frame_count++];
+    if (closure->function->lazy != NULL && !compile_lazy(closure->function)) {
+        runtime_error("Could not compile %s().", closure->function->name->chars);
+        return false;
+    }
+
+    call_frame_t *frame = &vm.frames[vm.frame_count];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
     frame->slots = vm.stack_top - arg_count - 1;
+    SIGNAL_FENCE(); // The profiler only walks frames that are filled in
+    vm.frame_count++;
     return true;
 }
 
@@ -130,6 +202,11 @@ static bool call_value(value_t calle, int arg_count)
             case OBJ_NATIVE: {
                 native_fn native = AS_NATIVE(calle);
                 value_t result = native(arg_count, vm.stack_top - arg_count);
+                if (vm.native_error) {
+                    // The stack was unwound when the error was reported
+                    vm.native_error = false;
+                    return false;
+                }
                 vm.stack_top -= arg_count + 1;
                 push(result);
                 return true;
@@ -234,7 +311,10 @@ static void close_upvalues(value_t *last)
         obj_upvalue_t *upvalue = vm.open_upvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        write_barrier((obj_t*)upvalue);
         vm.open_upvalues =  upvalue->next;
+        // Nothing follows a closed upvalue, the rest of the list may die
+        upvalue->next = NULL;
     }
 }
 
@@ -247,6 +327,7 @@ static void define_method(obj_string_t *name)
     if (name == vm.init_string && IS_CLOSURE(method)) {
         klass->initializer = AS_CLOSURE(method);
     }
+    write_barrier((obj_t*)klass);
 
     pop();
 }
@@ -263,7 +344,21 @@ static obj_string_t *concatenate(value_t a_val, value_t b_val)
     return concatenate_strings(a, b);
 }
 
-static interpret_result_e run(void)
+// Hands the instruction that is about to run to the profiling modes
+static void instrument(call_frame_t *frame, uint8_t instruction)
+{
+    obj_function_t *function = frame->closure->function;
+    int offset = (int)(frame->ip - function->chunk.code - 1);
+
+    if (vm.op_stats) record_op(instruction);
+    if (vm.coverage) record_hit(&function->chunk, offset);
+    if (vm.tracing) trace_instruction(function, offset, vm.frame_count);
+}
+
+// The dispatch loop. It is instantiated twice, by run_plain() and
+// run_instrumented(), so the loop that runs by default has no trace of the
+// profiling modes in it.
+static ALWAYS_INLINE interpret_result_e run_loop(bool instrumented)
 {
     call_frame_t *frame = &vm.frames[vm.frame_count - 1];
 
@@ -284,18 +379,8 @@ static interpret_result_e run(void)
        } while (false)
 
     for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-        printf("        ");
-        for (value_t *slot = vm.stack; slot < vm.stack_top; slot++) {
-            printf("[");
-            print_value(*slot);
-            printf("]");
-        }
-        printf("\n");
-        dissasemble_instruction(&frame->closure->function->chunk,
-                    (int)(frame->ip - frame->closure->function->chunk.code));
-#endif
         uint8_t instruction = READ_BYTE();
+        if (instrumented) instrument(frame, instruction);
         switch (instruction) {
             case OP_CONSTANT: {
                 value_t constant = READ_CONSTANT();
@@ -315,7 +400,9 @@ static interpret_result_e run(void)
             }
             case OP_SET_UPVALUE: {
                 uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
+                obj_upvalue_t *upvalue = frame->closure->upvalues[slot];
+                *upvalue->location = peek(0);
+                write_barrier((obj_t*)upvalue);
                 break;
             }
             case OP_GET_PROPERTY: {
@@ -347,6 +434,7 @@ static interpret_result_e run(void)
 
                 obj_instance_t *instance = AS_INSTANCE(peek(1));
                 table_set(&instance->fields, OBJ_VAL(READ_STRING()), peek(0));
+                write_barrier((obj_t*)instance);
                 value_t value = pop();
                 pop();
                 push(value);
@@ -356,16 +444,15 @@ static interpret_result_e run(void)
                 int count = READ_BYTE();
 
                 obj_array_t *array = new_array();
+                push(OBJ_VAL(array)); // Keep it reachable while the table grows
 
                 for (int i = 0; i < count; i++) {
-                    value_t element = peek(count - 1 - i);
+                    value_t element = peek(count - i);
                     table_set(&array->elements, NUMBER_VAL(i), element);
+                    write_barrier((obj_t*)array);
                 }
 
-                for (int i = 0; i < count; i++) {
-                    pop();
-                }
-
+                vm.stack_top -= count + 1;
                 push(OBJ_VAL(array));
                 break;
             }
@@ -390,18 +477,22 @@ static interpret_result_e run(void)
                 break;
             }
             case OP_SET_INDEX: {
-                value_t value = pop();
-                value_t index = pop();
-                value_t array_val = pop();
+                value_t value = peek(0);
+                value_t index = peek(1);
+                value_t array_val = peek(2);
 
                 if (!IS_OBJ(array_val) || AS_OBJ(array_val)->type != OBJ_ARRAY) {
                     runtime_error("Can only index arrays.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 
+                // Operands stay on the stack until table_set() is done,
+                // growing the table can trigger a collection.
                 obj_array_t *array = AS_ARRAY(array_val);
                 table_set(&array->elements, index, value);
+                write_barrier((obj_t*)array);
 
+                vm.stack_top -= 3;
                 push(value);
                 break;
             }
@@ -534,10 +625,14 @@ static interpret_result_e run(void)
             case OP_LOOP: {
                 uint16_t offset = READ_TWO_BYTES();
                 frame->ip -= offset;
+                // Backward jumps and calls are safe points: only the VM
+                // roots refer to objects here, so they may move
+                if (vm.compact_requested) compact_heap();
                 break;
             }
             case OP_CALL: {
                 int arg_count = READ_BYTE();
+                if (vm.compact_requested) compact_heap();
                 if (!call_value(peek(arg_count), arg_count)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
@@ -556,6 +651,10 @@ static interpret_result_e run(void)
             case OP_SUPER_INVOKE: {
                 obj_string_t *method = READ_STRING();
                 int arg_count = READ_BYTE();
+                if (!IS_CLASS(peek(0))) {
+                    runtime_error("Superclass must be a class.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
                 obj_class_t *superclass = AS_CLASS(pop());
                 if (!invoke_from_class(superclass, method, arg_count)) {
                     return INTERPRET_RUNTIME_ERROR;
@@ -575,11 +674,17 @@ static interpret_result_e run(void)
                     } else {
                         closure->upvalues[i] = frame->closure->upvalues[index];
                     }
+                    // Capturing can collect and promote the new closure
+                    write_barrier((obj_t*)closure);
                 }
                 break;
             }
             case OP_GET_SUPER: {
                 obj_string_t *name = READ_STRING();
+                if (!IS_CLASS(peek(0))) {
+                    runtime_error("Superclass must be a class.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
                 obj_class_t *superclass = AS_CLASS(pop());
 
                 if (!bind_method(superclass, name)) {
@@ -602,12 +707,23 @@ static interpret_result_e run(void)
                     runtime_error("Superclass must be a class.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                // Compiled code always has the subclass here, code loaded
+                // from a .loxc is only checked for its shape
+                if (!IS_CLASS(peek(0))) {
+                    runtime_error("Subclass must be a class.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
                 obj_class_t *subclass = AS_CLASS(peek(0));
                 table_add_all(&AS_CLASS(superclass)->methods, &subclass->methods);
+                write_barrier((obj_t*)subclass);
                 pop(); // Subclass
                 break;
             }
             case OP_METHOD: {
+                if (!IS_CLASS(peek(1)) || !IS_CLOSURE(peek(0))) {
+                    runtime_error("Methods must be functions declared in a class.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
                 define_method(READ_STRING());
                 break;
             }
@@ -622,6 +738,7 @@ static interpret_result_e run(void)
 
                 vm.stack_top = frame->slots;
                 push(result);
+                if (vm.frame_count == vm.base_frame) return INTERPRET_OK;
                 frame = &vm.frames[vm.frame_count - 1];
                 break;
             }
@@ -637,11 +754,60 @@ static interpret_result_e run(void)
 #undef BINARY_OP
 }
 
+static interpret_result_e run_plain(void)
+{
+    return run_loop(false);
+}
+
+static interpret_result_e run_instrumented(void)
+{
+    return run_loop(true);
+}
+
+static interpret_result_e run(void)
+{
+    return vm.instrumented ? run_instrumented() : run_plain();
+}
+
+// Calls the value below the arg_count arguments on top of the stack from
+// inside a native and runs it to completion, leaving its result in
+// *result. When it fails the error is already reported and the stack
+// unwound; the native then returns right away and the failure carries on
+// to its own caller.
+bool call_from_native(int arg_count, value_t *result)
+{
+    int frame_count = vm.frame_count;
+    if (!call_value(peek(arg_count), arg_count)) {
+        vm.native_error = true;
+        return false;
+    }
+
+    // Natives and classes without an initializer are done already
+    if (vm.frame_count > frame_count) {
+        int base_frame = vm.base_frame;
+        vm.base_frame = frame_count;
+        interpret_result_e status = run();
+        vm.base_frame = base_frame;
+        if (status != INTERPRET_OK) {
+            vm.native_error = true;
+            return false;
+        }
+    }
+
+    *result = pop();
+    return true;
+}
+
 interpret_result_e interpret(const char *source)
 {
     obj_function_t *function = compile(source);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    return interpret_function(function);
+}
 
+// Runs a script that is compiled already, e.g. loaded from a bytecode cache
+interpret_result_e interpret_function(obj_function_t *function)
+{
     push(OBJ_VAL(function));
     obj_closure_t *closure = new_closure(function);
     pop();
@@ -1,6 +1,7 @@
 #ifndef CLOX_VM_H
 #define CLOX_VM_H
 
+#include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
@@ -17,6 +18,8 @@ typedef struct {
 typedef struct {
     call_frame_t frames[FRAMES_MAX];
     int frame_count;
+    int base_frame; // run() returns once the frames above this one returned
+    bool native_error; // A native's call back into Lox failed and was reported
     value_t stack[STACK_MAX]; // Stack for values (eg. OP_RETURN pops 1)
     value_t *stack_top; // Points to first empty stack element
     table_t globals;
@@ -25,10 +28,30 @@ typedef struct {
     obj_upvalue_t *open_upvalues;
     size_t bytes_allocated;
     size_t next_gc;
-    obj_t *objects;
     int gray_count;
     int gray_capacity;
     obj_t **gray_stack;
+    gc_mode_e gc_mode;
+    size_t next_major; // Generational mode: heap size that makes the next collection a full one
+    int remembered_count;
+    int remembered_capacity;
+    obj_t **remembered; // Old (or black) objects written to since they were traced
+    gc_phase_e gc_phase; // Where the current collection cycle is
+    uint64_t gc_step_budget; // Incremental mode: nanoseconds one step may take
+    int gc_threads; // Threads that share stop-the-world marking
+    bool gc_compact; // Compact when full collections find the heap fragmented
+    bool compact_requested; // Compact at the next safe point
+    size_t gc_target; // Pacer: heap size collections may let the heap grow to
+    size_t gc_soft_limit; // Pacer: heap size collections try to stay under
+    double gc_time_ratio; // Pacer: share of time collections should take at most
+    bool gc_trace; // Record every collection cycle, see gc_trace.h
+    size_t heap_profile_rate; // Bytes between two heap profile samples, 0 when off
+    bool instrumented; // run() hands every instruction to the modes below
+    bool op_stats; // Count the instructions run() executes, see opstats.h
+    bool op_timing; // Also time them
+    bool coverage; // Count executions per instruction, see coverage.h
+    bool lazy_compile; // Pre-parse function bodies, compile them on the first call
+    bool tracing; // Record every instruction in the trace ring, see trace.h
 } vm_t;
 
 typedef enum {
@@ -42,8 +65,12 @@ extern vm_t vm;
 void init_vm(void);
 void free_vm(void);
 interpret_result_e interpret(const char *source);
+interpret_result_e interpret_function(obj_function_t *function);
 void push(value_t value);
 value_t pop(void);
+bool call_from_native(int arg_count, value_t *result);
+const char *native_name(native_fn function);
+native_fn find_native(const char *name);
 
 
 #endif
@@ -0,0 +1,131 @@
+#!/usr/bin/env python3
+"""Summarizes a clox heap snapshot (--heap-snapshot or heapSnapshot()).
+
+Prints the live heap by type and the objects that retain the most memory,
+where the retained size of an object is everything that would be freed
+with it: the nodes it dominates in the graph reachable from the root.
+
+usage: heap_summary.py snapshot.jsonl [--top N]
+"""
+
+import argparse
+import json
+from collections import defaultdict
+
+
+def load(path):
+    nodes = {}
+    with open(path) as file:
+        for line in file:
+            node = json.loads(line)
+            nodes[node["id"]] = node
+    return nodes
+
+
+def reverse_postorder(nodes):
+    order = []
+    seen = {0}
+    stack = [(0, iter(nodes[0]["edges"]))]
+    while stack:
+        node, edges = stack[-1]
+        for _, target in edges:
+            if target not in seen:
+                seen.add(target)
+                stack.append((target, iter(nodes[target]["edges"])))
+                break
+        else:
+            stack.pop()
+            order.append(node)
+    order.reverse()
+    return order
+
+
+def dominators(nodes):
+    """Immediate dominators (Cooper, Harvey and Kennedy)."""
+    order = reverse_postorder(nodes)
+    index = {node: i for i, node in enumerate(order)}
+    predecessors = defaultdict(list)
+    for node in order:
+        for _, target in nodes[node]["edges"]:
+            predecessors[target].append(node)
+
+    idom = {0: 0}
+
+    def intersect(a, b):
+        while a != b:
+            while index[a] > index[b]:
+                a = idom[a]
+            while index[b] > index[a]:
+                b = idom[b]
+        return a
+
+    changed = True
+    while changed:
+        changed = False
+        for node in order[1:]:
+            new = None
+            for pred in predecessors[node]:
+                if pred in idom:
+                    new = pred if new is None else intersect(pred, new)
+            if idom.get(node) != new:
+                idom[node] = new
+                changed = True
+    return order, idom
+
+
+def retained_sizes(nodes, order, idom):
+    retained = {node: nodes[node]["size"] for node in order}
+    for node in reversed(order[1:]):
+        retained[idom[node]] += retained[node]
+    return retained
+
+
+def label(node):
+    for key in ("class", "name", "value"):
+        if key in node:
+            return "%s %s" % (node["type"], json.dumps(node[key]))
+    return node["type"]
+
+
+def path_to(nodes, idom, node):
+    """Edge names from the root down the dominator tree."""
+    names = []
+    while node != 0:
+        parent = idom[node]
+        name = next((n for n, t in nodes[parent]["edges"] if t == node), "?")
+        names.append(name)
+        node = parent
+    return ".".join(reversed(names))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("snapshot")
+    parser.add_argument("--top", type=int, default=20)
+    args = parser.parse_args()
+
+    nodes = load(args.snapshot)
+    order, idom = dominators(nodes)
+    retained = retained_sizes(nodes, order, idom)
+
+    by_type = defaultdict(lambda: [0, 0])
+    for node in order[1:]:
+        by_type[nodes[node]["type"]][0] += 1
+        by_type[nodes[node]["type"]][1] += nodes[node]["size"]
+
+    print("%d objects, %d bytes" % (len(order) - 1, retained[0]))
+    print()
+    print("%-14s %10s %12s" % ("type", "count", "bytes"))
+    for name, (count, size) in sorted(by_type.items(), key=lambda item: -item[1][1]):
+        print("%-14s %10d %12d" % (name, count, size))
+
+    print()
+    print("%12s %10s  %s" % ("retained", "self", "object (path)"))
+    top = sorted(order[1:], key=lambda node: -retained[node])[:args.top]
+    for node in top:
+        print("%12d %10d  %s (%s)" % (retained[node], nodes[node]["size"],
+                                      label(nodes[node]), path_to(nodes, idom, node)))
+
+
+if __name__ == "__main__":
+    main()
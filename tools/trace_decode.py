@@ -0,0 +1,103 @@
+#!/usr/bin/env python3
+"""Decodes a clox execution trace (--trace).
+
+Prints the instructions left in the ring buffer, oldest first, one per
+line: the frame depth, the function and line, the bytecode offset, the
+instruction and the stack depth with the value on top of the stack before
+the instruction ran.
+
+usage: trace_decode.py trace.bin [--last N] [--function NAME]
+"""
+
+import argparse
+import struct
+
+VERSION = 1
+QNAN = 0x7FFC000000000000
+SIGN_BIT = 0x8000000000000000
+
+
+class Reader:
+    def __init__(self, data):
+        self.data = data
+        self.position = 0
+        self.order = "<"
+
+    def take(self, size):
+        chunk = self.data[self.position:self.position + size]
+        if len(chunk) < size:
+            raise SystemExit("truncated trace")
+        self.position += size
+        return chunk
+
+    def u32(self):
+        return struct.unpack(self.order + "I", self.take(4))[0]
+
+    def u64(self):
+        return struct.unpack(self.order + "Q", self.take(8))[0]
+
+    def name(self):
+        return self.take(self.u32()).decode("utf-8", "replace")
+
+
+def value(bits):
+    if bits & QNAN != QNAN:
+        number = struct.unpack("<d", struct.pack("<Q", bits))[0]
+        return "%.14g" % number
+    if bits & SIGN_BIT:
+        return "<obj %#x>" % (bits & ~(SIGN_BIT | QNAN))
+    return {1: "nil", 2: "false", 3: "true"}.get(bits & 3, "?")
+
+
+def load(path):
+    with open(path, "rb") as file:
+        reader = Reader(file.read())
+    if reader.take(8) != b"LOXTRACE":
+        raise SystemExit("%s is not a clox trace" % path)
+    if reader.u32() != VERSION:
+        reader.position -= 4
+        reader.order = ">"
+        if reader.u32() != VERSION:
+            raise SystemExit("unsupported trace version")
+
+    record = struct.Struct(reader.order + "QIIIHBB")
+    if reader.u32() != record.size:
+        raise SystemExit("unexpected record size")
+
+    ops = [reader.name() for _ in range(reader.u32())]
+    functions = []
+    for _ in range(reader.u32()):
+        line = reader.u32()
+        functions.append((reader.name(), line))
+    executed = reader.u64()
+    records = [record.unpack(reader.take(record.size)) for _ in range(reader.u32())]
+    return ops, functions, executed, records
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("trace")
+    parser.add_argument("--last", type=int, default=0, help="only the last N instructions")
+    parser.add_argument("--function", help="only instructions of this function")
+    args = parser.parse_args()
+
+    ops, functions, executed, records = load(args.trace)
+    print("%d instructions executed, the last %d kept" % (executed, len(records)))
+
+    first = executed - len(records)
+    if args.last:
+        first += max(0, len(records) - args.last)
+        records = records[-args.last:]
+
+    for index, (top, function, offset, line, stack, op, frames) in enumerate(records):
+        name, _ = functions[function]
+        if args.function and name != args.function:
+            continue
+        top_text = value(top) if stack > 0 else "-"
+        print("%10d %3d %-24s %04d %-18s %5d  %s" % (
+            first + index, frames, "%s:%d" % (name, line), offset,
+            ops[op] if op < len(ops) else "OP_%d" % op, stack, top_text))
+
+
+if __name__ == "__main__":
+    main()